@@ -0,0 +1,27 @@
+#ifndef _ENV_H
+#define _ENV_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Helpers for the TASKSYS_* environment variables that tune the task
+ * systems without changing the ITaskSystem interface.
+ */
+
+// Reads an on/off setting, e.g. TASKSYS_SYNC_HELP=0
+static inline bool envFlag(const char* name, bool default_value) {
+    const char* value = getenv(name);
+    if (!value || !*value) return default_value;
+    return strcmp(value, "0") != 0;
+}
+
+// Reads a non-negative integer setting, e.g. TASKSYS_SPIN_US=20
+static inline int envInt(const char* name, int default_value) {
+    const char* value = getenv(name);
+    if (!value || !*value) return default_value;
+    int parsed = atoi(value);
+    return parsed < 0 ? default_value : parsed;
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef _GRAIN_H
+#define _GRAIN_H
+
+#include <algorithm>
+#include <atomic>
+
+#include "CycleTimer.h"
+#include "itasksys.h"
+
+// time one chunk should take under GRAIN_ADAPTIVE
+#define ADAPTIVE_CHUNK_SECONDS 50e-6
+
+/*
+ * GrainSchedule: decides how many consecutive task ids of a bulk task
+ * launch a worker claims at once, according to the task system's
+ * GrainPolicy (see itasksys.h). One GrainSchedule is shared by all
+ * workers of a launch; under GRAIN_ADAPTIVE they feed it the time their
+ * chunks took through run(). Fields are relaxed atomics because a pool
+ * may reconfigure the schedule while a stale worker still reads it.
+ */
+class GrainSchedule {
+    public:
+        GrainSchedule() {
+            this->configure(GRAIN_FIXED, 1, 1);
+        }
+
+        void configure(GrainPolicy policy, int grain_size, int num_threads) {
+            this->policy.store(policy, std::memory_order_relaxed);
+            this->grain_size.store(std::max(1, grain_size), std::memory_order_relaxed);
+            this->num_threads.store(std::max(1, num_threads), std::memory_order_relaxed);
+            this->seconds_per_task.store(0.0, std::memory_order_relaxed);
+        }
+
+        // Number of ids to claim when `remaining` ids are left unclaimed
+        int chunk(int remaining) const {
+            GrainPolicy policy = this->policy.load(std::memory_order_relaxed);
+            int grain_size = this->grain_size.load(std::memory_order_relaxed);
+            int num_threads = this->num_threads.load(std::memory_order_relaxed);
+            int size = grain_size;
+            if (policy == GRAIN_GUIDED) {
+                size = remaining / (2 * num_threads);
+            } else if (policy == GRAIN_ADAPTIVE) {
+                // the first chunks probe at grain_size until a time is known
+                double spt = this->seconds_per_task.load(std::memory_order_relaxed);
+                if (spt > 0) {
+                    double tasks = ADAPTIVE_CHUNK_SECONDS / spt;
+                    size = tasks < remaining ? (int)tasks : remaining;
+                    // leave every thread a share of what is left
+                    size = std::min(size, remaining / num_threads);
+                }
+            }
+            return std::max(grain_size, size);
+        }
+
+        // Runs tasks [begin, end) of a launch of num_total_tasks
+        void run(IRunnable* runnable, int begin, int end, int num_total_tasks) {
+            if (this->policy.load(std::memory_order_relaxed) != GRAIN_ADAPTIVE) {
+                for (int i = begin; i < end; i++) {
+                    runnable->runTask(i, num_total_tasks);
+                }
+                return;
+            }
+
+            double start_time = CycleTimer::currentSeconds();
+            for (int i = begin; i < end; i++) {
+                runnable->runTask(i, num_total_tasks);
+            }
+            this->record(end - begin, CycleTimer::currentSeconds() - start_time);
+        }
+
+    private:
+        std::atomic<GrainPolicy> policy;
+        std::atomic<int> grain_size;
+        std::atomic<int> num_threads;
+        // moving average of the measured time per task, 0 until measured
+        std::atomic<double> seconds_per_task;
+
+        void record(int count, double seconds) {
+            if (count <= 0) return;
+            double sample = seconds / count;
+            double spt = this->seconds_per_task.load(std::memory_order_relaxed);
+            spt = (spt > 0) ? 0.75 * spt + 0.25 * sample : sample;
+            this->seconds_per_task.store(spt, std::memory_order_relaxed);
+        }
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _ID_SET_H
+#define _ID_SET_H
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * IdSet: a set of non-negative ids kept as one bit per id, grown up to
+ * the largest id inserted, so a set of TaskIDs costs one bit per launch
+ * ever issued rather than a word per member. Not thread-safe.
+ */
+class IdSet {
+    public:
+        void insert(int id) {
+            if (id < 0) return;
+            size_t word = id / 64;
+            if (word >= this->words.size()) this->words.resize(word + 1, 0);
+            this->words[word] |= (uint64_t)1 << (id % 64);
+        }
+
+        bool contains(int id) const {
+            if (id < 0 || (size_t)(id / 64) >= this->words.size()) return false;
+            return (this->words[id / 64] >> (id % 64)) & 1;
+        }
+
+    private:
+        std::vector<uint64_t> words;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _IDLE_H
+#define _IDLE_H
+
+#include <thread>
+
+#include "CycleTimer.h"
+#include "env.h"
+
+// default length of the spinning and yielding phases, in microseconds
+#define DEFAULT_SPIN_US 20
+#define DEFAULT_YIELD_US 80
+
+// Tells the core this is a spin-wait loop
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+/*
+ * IdleBackoff: what a worker does between running out of work and
+ * parking on a condition variable. It first spins with a pause
+ * instruction for TASKSYS_SPIN_US microseconds, then yields its core
+ * for TASKSYS_YIELD_US microseconds, so back-to-back launches do not pay
+ * for a futex wake while an idle pool still drops to zero CPU.
+ */
+class IdleBackoff {
+    public:
+        IdleBackoff() {
+            this->spin_seconds = envInt("TASKSYS_SPIN_US", DEFAULT_SPIN_US) * 1e-6;
+            this->yield_seconds = envInt("TASKSYS_YIELD_US", DEFAULT_YIELD_US) * 1e-6;
+        }
+
+        // Polls ready() until it returns true, or returns false once the
+        // spin and yield budget is used up and the caller should park
+        template <typename Ready>
+        bool wait(Ready ready) const {
+            double start_time = CycleTimer::currentSeconds();
+            while (!ready()) {
+                double elapsed = CycleTimer::currentSeconds() - start_time;
+                if (elapsed < this->spin_seconds) {
+                    for (int i = 0; i < 32; i++) cpuRelax();
+                } else if (elapsed < this->spin_seconds + this->yield_seconds) {
+                    std::this_thread::yield();
+                } else {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+        double spin_seconds;
+        double yield_seconds;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef _PLACEMENT_H
+#define _PLACEMENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+// scratch memory and per-worker slots are aligned and padded to this
+#define CACHE_LINE_SIZE 64
+
+/*
+ * ThreadPlacement: pins the workers of a task system to CPUs according
+ * to TASKSYS_PLACEMENT:
+ *
+ *   none (default)  leave placement to the OS scheduler
+ *   compact         fill one socket / last-level cache domain before the
+ *                   next, one thread per physical core before SMT siblings
+ *   scatter         round-robin over the domains, so each worker gets as
+ *                   much cache and memory bandwidth as possible
+ *   <cpu list>      explicit CPUs such as "0-3,8,10", used in order
+ *
+ * Topology comes from sysconf() and /sys/devices/system/cpu, restricted
+ * to the CPUs the process may run on. Worker i runs on cpus[i % size];
+ * the thread calling run()/sync() is never pinned. Placement is a no-op
+ * outside Linux or when the topology cannot be read.
+ */
+class ThreadPlacement {
+    public:
+        ThreadPlacement() {
+            const char* value = getenv("TASKSYS_PLACEMENT");
+            if (!value || !*value || strcmp(value, "none") == 0) return;
+            if (strcmp(value, "compact") == 0) {
+                this->cpus = orderCpus(false);
+            } else if (strcmp(value, "scatter") == 0) {
+                this->cpus = orderCpus(true);
+            } else if (!parseCpuList(value, &this->cpus)) {
+                fprintf(stderr, "TASKSYS_PLACEMENT: cannot parse '%s', threads are not pinned\n", value);
+            }
+        }
+
+        // Pins thread to the CPU chosen for worker
+        void pin(std::thread &thread, int worker) const {
+#ifdef __linux__
+            if (this->cpus.empty()) return;
+            int cpu = this->cpus[worker % this->cpus.size()];
+            if (cpu >= CPU_SETSIZE) return;
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpu, &cpuset);
+            pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset);
+#endif
+        }
+
+        // Parses a Linux CPU list such as "0-3,8"
+        static bool parseCpuList(const char* list, std::vector<int> *cpus) {
+            const char* p = list;
+            while (*p) {
+                char* end;
+                long first = strtol(p, &end, 10);
+                if (end == p || first < 0) return false;
+                long last = first;
+                p = end;
+                if (*p == '-') {
+                    last = strtol(p + 1, &end, 10);
+                    if (end == p + 1 || last < first) return false;
+                    p = end;
+                }
+                for (long cpu = first; cpu <= last; cpu++) cpus->push_back((int)cpu);
+                if (*p == ',') p++;
+                else if (*p && *p != '\n') return false;
+                else break;
+            }
+            return !cpus->empty();
+        }
+
+    private:
+        std::vector<int> cpus;
+
+        struct CpuInfo {
+            int cpu;
+            int package;
+            int llc;        // id of the last-level cache, -1 if unknown
+            int core;
+            int smt;        // rank among the hardware threads of its core
+        };
+
+        static int readSysfsInt(const std::string &path, int default_value) {
+            FILE* file = fopen(path.c_str(), "r");
+            if (!file) return default_value;
+            int value = default_value;
+            if (fscanf(file, "%d", &value) != 1) value = default_value;
+            fclose(file);
+            return value;
+        }
+
+        static bool sameDomain(const CpuInfo &a, const CpuInfo &b) {
+            return a.package == b.package && a.llc == b.llc;
+        }
+
+        static std::vector<int> orderCpus(bool scatter) {
+            std::vector<int> order;
+#ifdef __linux__
+            cpu_set_t allowed;
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return order;
+
+            std::vector<CpuInfo> infos;
+            long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+            for (int cpu = 0; cpu < num_cpus && cpu < CPU_SETSIZE; cpu++) {
+                if (!CPU_ISSET(cpu, &allowed)) continue;
+                std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+                CpuInfo info;
+                info.cpu = cpu;
+                info.package = readSysfsInt(base + "/topology/physical_package_id", 0);
+                info.llc = readSysfsInt(base + "/cache/index3/id", -1);
+                info.core = readSysfsInt(base + "/topology/core_id", cpu);
+                info.smt = 0;
+                infos.push_back(info);
+            }
+
+            // cpus sharing a (package, core) are SMT siblings, ranked by cpu id
+            for (CpuInfo &info : infos) {
+                for (const CpuInfo &other : infos) {
+                    if (other.package == info.package && other.core == info.core && other.cpu < info.cpu) {
+                        info.smt++;
+                    }
+                }
+            }
+
+            // compact order: domain by domain, physical cores before siblings
+            std::sort(infos.begin(), infos.end(), [](const CpuInfo &a, const CpuInfo &b) {
+                if (a.package != b.package) return a.package < b.package;
+                if (a.llc != b.llc) return a.llc < b.llc;
+                if (a.smt != b.smt) return a.smt < b.smt;
+                if (a.core != b.core) return a.core < b.core;
+                return a.cpu < b.cpu;
+            });
+            if (!scatter) {
+                for (const CpuInfo &info : infos) order.push_back(info.cpu);
+                return order;
+            }
+
+            // scatter order: take the next cpu of each domain in turn
+            std::vector<std::vector<int> > domains;
+            for (size_t i = 0; i < infos.size(); i++) {
+                if (i == 0 || !sameDomain(infos[i - 1], infos[i])) domains.push_back(std::vector<int>());
+                domains.back().push_back(infos[i].cpu);
+            }
+            for (size_t rank = 0; order.size() < infos.size(); rank++) {
+                for (const std::vector<int> &domain : domains) {
+                    if (rank < domain.size()) order.push_back(domain[rank]);
+                }
+            }
+#endif
+            return order;
+        }
+};
+
+#endif
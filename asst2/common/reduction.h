@@ -0,0 +1,42 @@
+#ifndef _REDUCTION_H
+#define _REDUCTION_H
+
+#include "itasksys.h"
+#include "scratch.h"
+
+/*
+ * Reduction: IReduction whose partial results are values of type T,
+ * each on its own cache lines. Subclasses fold task task_id into a
+ * partial with accumulate() and merge two partials with combine();
+ * after ITaskSystem::runReduce() returns, result() holds the combined
+ * value. T must be copyable; its identity is given at construction.
+ */
+template <typename T>
+class Reduction: public IReduction {
+    public:
+        Reduction(const T &identity) : identity(identity), partials(0) {}
+        virtual ~Reduction() {}
+
+        virtual void accumulate(int task_id, int num_total_tasks, T &partial) = 0;
+        virtual void combine(T &into, const T &from) = 0;
+
+        const T& result() { return this->partials[0]; }
+
+        void preparePartials(int num_workers) {
+            this->partials = WorkerLocal<T>(num_workers, this->identity);
+        }
+
+        void runTask(int task_id, int num_total_tasks, int worker) {
+            this->accumulate(task_id, num_total_tasks, this->partials[worker]);
+        }
+
+        void combinePartials(int into, int from) {
+            this->combine(this->partials[into], this->partials[from]);
+        }
+
+    private:
+        T identity;
+        WorkerLocal<T> partials;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef _SCRATCH_H
+#define _SCRATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "placement.h"
+
+// size of the first block of a ScratchArena
+#define SCRATCH_BLOCK_BYTES (64 * 1024)
+
+/*
+ * ScratchArena: bump allocator for the temporaries of one worker.
+ * alloc() hands out cache-line aligned memory from the current block
+ * and chains a new, larger block when it runs out, so earlier pointers
+ * stay valid. mark() and release() free everything allocated since the
+ * mark, and reset() everything at once; blocks are kept for reuse, and
+ * a reset arena that had to chain merges them into one block.
+ *
+ * Only the owning thread may use an arena, resets included: the task
+ * system rewinds it on the owner's own thread when the owner is done
+ * running a task (see ITaskSystem::scratch()). The trailing padding
+ * keeps neighbouring arenas in an array off each other's cache lines.
+ */
+class ScratchArena {
+    public:
+        struct Mark {
+            int block;
+            size_t used;
+        };
+
+        ScratchArena() {
+            this->current = 0;
+            this->used = 0;
+            this->total = 0;
+        }
+
+        ~ScratchArena() {
+            for (Block &block : this->blocks) delete[] block.storage;
+        }
+
+        void* alloc(size_t bytes) {
+            bytes = roundUp(bytes == 0 ? 1 : bytes);
+            while (this->current < (int)this->blocks.size()) {
+                Block &block = this->blocks[this->current];
+                if (this->used + bytes <= block.size) {
+                    void* ptr = block.data + this->used;
+                    this->used += bytes;
+                    return ptr;
+                }
+                this->current++;
+                this->used = 0;
+            }
+            size_t size = this->total ? 2 * this->total : SCRATCH_BLOCK_BYTES;
+            this->addBlock(size < bytes ? bytes : size);
+            this->current = (int)this->blocks.size() - 1;
+            this->used = bytes;
+            return this->blocks.back().data;
+        }
+
+        template <typename T>
+        T* allocArray(size_t count) {
+            return static_cast<T*>(this->alloc(count * sizeof(T)));
+        }
+
+        Mark mark() const {
+            Mark mark = {this->current, this->used};
+            return mark;
+        }
+
+        void release(const Mark &mark) {
+            this->current = mark.block;
+            this->used = mark.used;
+        }
+
+        void reset() {
+            if (this->blocks.size() > 1) {
+                size_t total = this->total;
+                for (Block &block : this->blocks) delete[] block.storage;
+                this->blocks.clear();
+                this->total = 0;
+                this->addBlock(total);
+            }
+            this->current = 0;
+            this->used = 0;
+        }
+
+        // Bytes of memory the arena holds
+        size_t capacity() const { return this->total; }
+
+    private:
+        struct Block {
+            char *storage;
+            char *data;     // storage rounded up to a cache line
+            size_t size;
+        };
+        std::vector<Block> blocks;
+        int current;    // block alloc() takes from
+        size_t used;    // bytes of it in use
+        size_t total;
+        char pad[CACHE_LINE_SIZE];
+
+        static size_t roundUp(size_t bytes) {
+            return (bytes + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+        }
+
+        void addBlock(size_t size) {
+            Block block;
+            block.storage = new char[size + CACHE_LINE_SIZE];
+            block.data = (char*)roundUp((size_t)(uintptr_t)block.storage);
+            block.size = size;
+            this->blocks.push_back(block);
+            this->total += size;
+        }
+
+        ScratchArena(const ScratchArena&);
+        ScratchArena& operator=(const ScratchArena&);
+};
+
+/*
+ * ScratchScope: gives back on destruction everything allocated from an
+ * arena during its lifetime, for temporaries that should not outlive a
+ * runTask() call.
+ */
+class ScratchScope {
+    public:
+        ScratchScope(ScratchArena *arena) : arena(arena), saved(arena->mark()) {}
+        ~ScratchScope() { this->arena->release(this->saved); }
+    private:
+        ScratchArena *arena;
+        ScratchArena::Mark saved;
+};
+
+/*
+ * WorkerLocal: one T per worker of a task system, each on its own cache
+ * lines, indexed by ITaskSystem::workerId(). Meant for thread-private
+ * partial results that are combined once the launch is complete.
+ */
+template <typename T>
+class WorkerLocal {
+    public:
+        WorkerLocal(int num_workers, const T &value = T()) {
+            this->slots = std::vector<Slot>(num_workers);
+            for (Slot &slot : this->slots) slot.value = value;
+        }
+
+        T& operator[](int worker) { return this->slots[worker].value; }
+        int size() const { return (int)this->slots.size(); }
+
+    private:
+        struct Slot {
+            T value;
+            char pad[CACHE_LINE_SIZE];
+        };
+        std::vector<Slot> slots;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _SMALL_VECTOR_H
+#define _SMALL_VECTOR_H
+
+#include <algorithm>
+
+/*
+ * SmallVector: growable array that keeps its first N items inline and
+ * only allocates once it outgrows them. clear() keeps any allocated
+ * storage, so a recycled owner does not allocate again. T must be
+ * trivially copyable (it is used for pointers and ids).
+ */
+template <typename T, int N>
+class SmallVector {
+    public:
+        SmallVector() {
+            this->items = this->inline_items;
+            this->count = 0;
+            this->capacity = N;
+        }
+
+        ~SmallVector() {
+            if (this->items != this->inline_items) delete[] this->items;
+        }
+
+        void push_back(const T &item) {
+            if (this->count == this->capacity) {
+                T *grown = new T[2 * this->capacity];
+                std::copy(this->items, this->items + this->count, grown);
+                if (this->items != this->inline_items) delete[] this->items;
+                this->items = grown;
+                this->capacity *= 2;
+            }
+            this->items[this->count++] = item;
+        }
+
+        // removes every item equal to item, keeping the others in order
+        void remove(const T &item) {
+            this->count = std::remove(this->items, this->items + this->count, item) - this->items;
+        }
+
+        void clear() { this->count = 0; }
+        int size() const { return this->count; }
+        bool empty() const { return this->count == 0; }
+        T& operator[](int i) { return this->items[i]; }
+        T* begin() { return this->items; }
+        T* end() { return this->items + this->count; }
+
+    private:
+        T inline_items[N];
+        T *items;
+        int count;
+        int capacity;
+
+        SmallVector(const SmallVector&);
+        SmallVector& operator=(const SmallVector&);
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef _TASK_GRAPH_H
+#define _TASK_GRAPH_H
+
+#include <algorithm>
+#include <vector>
+
+#include "itasksys.h"
+
+/*
+ * TaskGraphCapture: records a sequence of runAsyncWithDeps() calls
+ * instead of running them. The TaskIDs it returns name the recorded
+ * launches, and deps may only name launches recorded before; any other
+ * dependency is ignored.
+ */
+class TaskGraphCapture {
+    public:
+        struct Launch {
+            IRunnable *runnable;
+            int num_total_tasks;
+            std::vector<int> deps;
+        };
+
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps) {
+            Launch launch;
+            launch.runnable = runnable;
+            launch.num_total_tasks = num_total_tasks;
+            TaskID id = (TaskID)this->launches.size();
+            for (TaskID dep : deps) {
+                if (dep >= 0 && dep < id) launch.deps.push_back(dep);
+            }
+            std::sort(launch.deps.begin(), launch.deps.end());
+            launch.deps.erase(std::unique(launch.deps.begin(), launch.deps.end()), launch.deps.end());
+            this->launches.push_back(launch);
+            return id;
+        }
+
+        std::vector<Launch> launches;
+};
+
+/*
+ * TaskGraph: immutable form of a capture, launched as a whole with
+ * ITaskSystem::replay(). Capture order is a topological order, and the
+ * successors and dependencies of each launch are stored in flat
+ * arrays, so a replay only wires up precomputed edges. Each launch also
+ * carries the length of the longest chain it starts, counted in
+ * launches and in sub-tasks, for task systems that run the critical
+ * path first.
+ */
+class TaskGraph {
+    public:
+        struct Node {
+            IRunnable *runnable;
+            int num_total_tasks;
+            int num_deps;
+            long critical_path;     // launches on the longest chain from here
+            long critical_work;     // sub-tasks on the heaviest chain from here
+        };
+
+        TaskGraph(const TaskGraphCapture &capture) {
+            int num_nodes = (int)capture.launches.size();
+            this->nodes.resize(num_nodes);
+            this->dep_offsets.assign(num_nodes + 1, 0);
+            this->successor_offsets.assign(num_nodes + 1, 0);
+            for (int i = 0; i < num_nodes; i++) {
+                const TaskGraphCapture::Launch &launch = capture.launches[i];
+                Node &node = this->nodes[i];
+                node.runnable = launch.runnable;
+                node.num_total_tasks = launch.num_total_tasks;
+                node.num_deps = (int)launch.deps.size();
+                this->dep_offsets[i + 1] = this->dep_offsets[i] + node.num_deps;
+                for (int dep : launch.deps) this->successor_offsets[dep + 1]++;
+            }
+            for (int i = 0; i < num_nodes; i++) this->successor_offsets[i + 1] += this->successor_offsets[i];
+
+            this->dep_ids.resize(this->dep_offsets[num_nodes]);
+            this->successor_ids.resize(this->successor_offsets[num_nodes]);
+            std::vector<int> filled(this->successor_offsets.begin(), this->successor_offsets.end() - 1);
+            for (int i = 0; i < num_nodes; i++) {
+                const std::vector<int> &deps = capture.launches[i].deps;
+                std::copy(deps.begin(), deps.end(), this->dep_ids.begin() + this->dep_offsets[i]);
+                for (int dep : deps) this->successor_ids[filled[dep]++] = i;
+            }
+
+            // successors come later in capture order, so walk it backwards
+            for (int i = num_nodes - 1; i >= 0; i--) {
+                Node &node = this->nodes[i];
+                long path = 0, work = 0;
+                for (const int *s = this->successors(i); s != this->successors(i) + this->numSuccessors(i); s++) {
+                    path = std::max(path, this->nodes[*s].critical_path);
+                    work = std::max(work, this->nodes[*s].critical_work);
+                }
+                node.critical_path = path + 1;
+                node.critical_work = work + std::max(1, node.num_total_tasks);
+            }
+        }
+
+        int size() const { return (int)this->nodes.size(); }
+        const Node& node(int i) const { return this->nodes[i]; }
+
+        // capture-order indices of the launches node i depends on
+        int numDeps(int i) const { return this->dep_offsets[i + 1] - this->dep_offsets[i]; }
+        const int* deps(int i) const { return this->dep_ids.data() + this->dep_offsets[i]; }
+
+        // capture-order indices of the launches that depend on node i
+        int numSuccessors(int i) const { return this->successor_offsets[i + 1] - this->successor_offsets[i]; }
+        const int* successors(int i) const { return this->successor_ids.data() + this->successor_offsets[i]; }
+
+    private:
+        std::vector<Node> nodes;
+        std::vector<int> dep_offsets;
+        std::vector<int> dep_ids;
+        std::vector<int> successor_offsets;
+        std::vector<int> successor_ids;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef _TILE_ORDER_H
+#define _TILE_ORDER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "itasksys.h"
+
+/*
+ * Space-filling curves for ordering the tiles of a grid launch (see
+ * ITaskSystem::runGrid). Task systems hand consecutive task ids to the
+ * same worker, so a curve that keeps consecutive tiles adjacent in
+ * space keeps each worker's tiles, and the data they touch, close.
+ */
+
+// Number of bits needed for coordinates below n
+static inline int tileCoordBits(int n) {
+    int bits = 0;
+    while ((1 << bits) < n) bits++;
+    return bits;
+}
+
+// Interleaves the low bits of coords, x least significant
+static inline uint64_t interleaveBits(const uint32_t coords[3], int dims, int bits) {
+    uint64_t code = 0;
+    for (int b = 0; b < bits; b++) {
+        for (int d = 0; d < dims; d++) {
+            code |= (uint64_t)((coords[d] >> b) & 1) << (b * dims + d);
+        }
+    }
+    return code;
+}
+
+static inline uint64_t mortonCode(const int tile[3], int dims, int bits) {
+    uint32_t coords[3] = {(uint32_t)tile[0], (uint32_t)tile[1], (uint32_t)tile[2]};
+    return interleaveBits(coords, dims, bits);
+}
+
+/*
+ * Position of a tile along the Hilbert curve through a 2^bits cube of
+ * dims dimensions, using Skilling's transform of the coordinates into
+ * the transposed Hilbert index ("Programming the Hilbert curve", 2004).
+ */
+static inline uint64_t hilbertCode(const int tile[3], int dims, int bits) {
+    uint32_t x[3] = {(uint32_t)tile[0], (uint32_t)tile[1], (uint32_t)tile[2]};
+    if (bits == 0) return 0;
+    uint32_t top = 1u << (bits - 1);
+
+    // inverse undo of the excess work
+    for (uint32_t q = top; q > 1; q >>= 1) {
+        uint32_t p = q - 1;
+        for (int i = 0; i < dims; i++) {
+            if (x[i] & q) {
+                x[0] ^= p;
+            } else {
+                uint32_t t = (x[0] ^ x[i]) & p;
+                x[0] ^= t;
+                x[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    for (int i = 1; i < dims; i++) x[i] ^= x[i - 1];
+    uint32_t t = 0;
+    for (uint32_t q = top; q > 1; q >>= 1) {
+        if (x[dims - 1] & q) t ^= q - 1;
+    }
+    for (int i = 0; i < dims; i++) x[i] ^= t;
+
+    // the transposed index keeps the most significant digit in x[0]
+    uint32_t reversed[3] = {0, 0, 0};
+    for (int i = 0; i < dims; i++) reversed[i] = x[dims - 1 - i];
+    return interleaveBits(reversed, dims, bits);
+}
+
+/*
+ * Lists the tiles of a grid of num_tiles[0] x num_tiles[1] x
+ * num_tiles[2] tiles in the given order, as row-major tile indices
+ * (x fastest).
+ */
+static inline std::vector<int> tileOrder(const int num_tiles[3], int dims, TileOrder order) {
+    int total = num_tiles[0] * num_tiles[1] * num_tiles[2];
+    std::vector<int> tiles(total);
+    for (int i = 0; i < total; i++) tiles[i] = i;
+    if (order == TILE_ORDER_ROW_MAJOR || dims == 1) return tiles;
+
+    int bits = 0;
+    for (int d = 0; d < dims; d++) bits = std::max(bits, tileCoordBits(num_tiles[d]));
+    std::vector<std::pair<uint64_t, int> > keyed(total);
+    for (int i = 0; i < total; i++) {
+        int tile[3] = {i % num_tiles[0], (i / num_tiles[0]) % num_tiles[1], i / (num_tiles[0] * num_tiles[1])};
+        uint64_t code = (order == TILE_ORDER_MORTON) ? mortonCode(tile, dims, bits) : hilbertCode(tile, dims, bits);
+        keyed[i] = std::make_pair(code, i);
+    }
+    std::sort(keyed.begin(), keyed.end());
+    for (int i = 0; i < total; i++) tiles[i] = keyed[i].second;
+    return tiles;
+}
+
+#endif
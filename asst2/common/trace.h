@@ -0,0 +1,193 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "CycleTimer.h"
+
+// events each worker keeps; older events are overwritten
+#define TRACE_BUFFER_EVENTS (1 << 16)
+
+enum TraceEventType {
+    TRACE_LAUNCH,       // a bulk launch was issued
+    TRACE_READY,        // its dependencies completed and it was queued
+    TRACE_CLAIM,        // a worker claimed sub-tasks [begin, end)
+    TRACE_RUN_BEGIN,    // runTask() calls for [begin, end) started
+    TRACE_RUN_END,
+    TRACE_PARK,         // the worker went to sleep
+    TRACE_UNPARK,
+    TRACE_CANCEL,       // sub-tasks [begin, end) of a cancelled launch were dropped
+};
+
+struct TraceEvent {
+    CycleTimer::SysClock ticks;
+    TraceEventType type;
+    int task_id;
+    int begin;
+    int end;
+};
+
+/*
+ * TraceBuffer: ring buffer of the events of one worker. Only the owning
+ * thread records into it.
+ */
+class TraceBuffer {
+    public:
+        TraceBuffer() {
+            this->events = new TraceEvent[TRACE_BUFFER_EVENTS];
+            this->count = 0;
+        }
+
+        ~TraceBuffer() {
+            delete[] this->events;
+        }
+
+        void record(TraceEventType type, int task_id, int begin, int end) {
+            TraceEvent &event = this->events[this->count % TRACE_BUFFER_EVENTS];
+            event.ticks = CycleTimer::currentTicks();
+            event.type = type;
+            event.task_id = task_id;
+            event.begin = begin;
+            event.end = end;
+            this->count++;
+        }
+
+        TraceEvent *events;
+        long count;     // events ever recorded
+};
+
+/*
+ * Tracer: optional scheduler trace of a task system, enabled by setting
+ * TASKSYS_TRACE to a file prefix. Workers 0..num_workers-1 each record
+ * into their own TraceBuffer without a lock; any other worker id, such
+ * as -1 for a thread calling run() or sync(), stands for a thread
+ * outside the task system, which gets a TraceBuffer of its own, looked
+ * up under a lock. With tracing off record() is a single branch. dump()
+ * writes <prefix>.<engine>.json in the Chrome trace event format
+ * (chrome://tracing, ui.perfetto.dev) and must only be called once no
+ * thread records any more.
+ */
+class Tracer {
+    public:
+        Tracer(const char* engine, int num_workers) {
+            this->buffers = nullptr;
+            this->num_workers = num_workers;
+            const char* prefix = getenv("TASKSYS_TRACE");
+            if (!prefix || !*prefix) return;
+            this->path = std::string(prefix) + "." + engine + ".json";
+            this->buffers = new TraceBuffer[num_workers];
+        }
+
+        ~Tracer() {
+            delete[] this->buffers;
+            for (auto &entry : this->outside) delete entry.second;
+        }
+
+        void record(int worker, TraceEventType type, int task_id, int begin = 0, int end = 0) {
+            if (!this->buffers) return;
+            TraceBuffer *buffer = (worker >= 0 && worker < this->num_workers) ? &this->buffers[worker]
+                                                                            : this->outsideBuffer();
+            buffer->record(type, task_id, begin, end);
+        }
+
+        void dump() {
+            if (!this->buffers) return;
+            FILE* file = fopen(this->path.c_str(), "w");
+            if (!file) {
+                fprintf(stderr, "TASKSYS_TRACE: cannot write %s\n", this->path.c_str());
+                return;
+            }
+
+            // the workers' buffers, then those of outside threads as callers
+            std::vector<TraceBuffer*> all;
+            for (int w = 0; w < this->num_workers; w++) all.push_back(&this->buffers[w]);
+            for (auto &entry : this->outside) all.push_back(entry.second);
+
+            // timestamps are relative to the earliest event still buffered
+            CycleTimer::SysClock origin = 0;
+            bool has_origin = false;
+            for (TraceBuffer *buffer_ptr : all) {
+                TraceBuffer &buffer = *buffer_ptr;
+                long first = buffer.count > TRACE_BUFFER_EVENTS ? buffer.count - TRACE_BUFFER_EVENTS : 0;
+                if (first < buffer.count) {
+                    CycleTimer::SysClock ticks = buffer.events[first % TRACE_BUFFER_EVENTS].ticks;
+                    if (!has_origin || ticks < origin) origin = ticks;
+                    has_origin = true;
+                }
+            }
+            double us_per_tick = CycleTimer::secondsPerTick() * 1e6;
+
+            fprintf(file, "{\"traceEvents\":[\n");
+            bool first_event = true;
+            for (int w = 0; w < (int)all.size(); w++) {
+                const char* thread_name = (w >= this->num_workers) ? "caller" : "worker";
+                fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+                        "\"args\":{\"name\":\"%s %d\"}}", first_event ? "" : ",\n", w, thread_name, w);
+                first_event = false;
+
+                TraceBuffer &buffer = *all[w];
+                long first = buffer.count > TRACE_BUFFER_EVENTS ? buffer.count - TRACE_BUFFER_EVENTS : 0;
+                for (long i = first; i < buffer.count; i++) {
+                    const TraceEvent &event = buffer.events[i % TRACE_BUFFER_EVENTS];
+                    double ts = (double)(event.ticks - origin) * us_per_tick;
+                    fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%s\",%s\"ts\":%.3f,\"pid\":0,\"tid\":%d,"
+                            "\"args\":{\"task\":%d,\"begin\":%d,\"end\":%d}}",
+                            eventName(event.type), eventPhase(event.type),
+                            isInstant(event.type) ? "\"s\":\"t\"," : "", ts, w,
+                            event.task_id, event.begin, event.end);
+                }
+            }
+            fprintf(file, "\n]}\n");
+            fclose(file);
+        }
+
+    private:
+        TraceBuffer *buffers;
+        int num_workers;
+        std::string path;
+        // buffers of the threads outside the task system, guarded by outside_mutex
+        std::mutex outside_mutex;
+        std::vector<std::pair<std::thread::id, TraceBuffer*> > outside;
+
+        TraceBuffer* outsideBuffer() {
+            std::lock_guard<std::mutex> lock(this->outside_mutex);
+            std::thread::id self = std::this_thread::get_id();
+            for (auto &entry : this->outside) {
+                if (entry.first == self) return entry.second;
+            }
+            this->outside.push_back(std::make_pair(self, new TraceBuffer()));
+            return this->outside.back().second;
+        }
+
+        static const char* eventName(TraceEventType type) {
+            switch (type) {
+                case TRACE_LAUNCH: return "launch";
+                case TRACE_READY: return "ready";
+                case TRACE_CLAIM: return "claim";
+                case TRACE_RUN_BEGIN:
+                case TRACE_RUN_END: return "run";
+                case TRACE_PARK:
+                case TRACE_UNPARK: return "parked";
+                case TRACE_CANCEL: return "cancel";
+            }
+            return "unknown";
+        }
+
+        static bool isInstant(TraceEventType type) {
+            return type == TRACE_LAUNCH || type == TRACE_READY || type == TRACE_CLAIM || type == TRACE_CANCEL;
+        }
+
+        static const char* eventPhase(TraceEventType type) {
+            if (type == TRACE_RUN_BEGIN || type == TRACE_PARK) return "B";
+            if (type == TRACE_RUN_END || type == TRACE_UNPARK) return "E";
+            return "i";
+        }
+};
+
+#endif
@@ -1,9 +1,29 @@
 #ifndef _ITASKSYS_H
 #define _ITASKSYS_H
+#include <atomic>
 #include <vector>
+#include "scratch.h"
 
 typedef int TaskID;
 
+/*
+  How many consecutive task ids of a bulk task launch a worker claims
+  at once:
+
+   - GRAIN_FIXED: always grain_size ids.
+
+   - GRAIN_GUIDED: a share of the ids not yet claimed, so chunks shrink
+     as the launch drains, but never below grain_size ids.
+
+   - GRAIN_ADAPTIVE: as many ids as fit in a fixed time budget given the
+     measured time per task, but never below grain_size ids.
+ */
+enum GrainPolicy {
+    GRAIN_FIXED,
+    GRAIN_GUIDED,
+    GRAIN_ADAPTIVE,
+};
+
 class IRunnable {
     public:
         virtual ~IRunnable();
@@ -18,6 +38,115 @@ class IRunnable {
              task launch.
          */
         virtual void runTask(int task_id, int num_total_tasks) = 0;
+
+        /*
+          Whether a launch of this runnable may be fused with the
+          launch it solely depends on when both have the same
+          num_total_tasks: true promises that task i only reads what
+          task i of that launch wrote, so a task system may run the two
+          as one launch whose task i runs both in turn. False by
+          default.
+         */
+        virtual bool fusable();
+};
+
+/*
+  Order in which runGrid() issues the tiles of a grid: row by row with
+  x fastest, or along a Morton (Z-order) or Hilbert curve, which keep
+  consecutive tiles next to each other in 2D and 3D.
+ */
+enum TileOrder {
+    TILE_ORDER_ROW_MAJOR,
+    TILE_ORDER_MORTON,
+    TILE_ORDER_HILBERT,
+};
+
+/*
+  A box of a grid launch: the indices begin[d] <= i < end[d] in each
+  dimension d. Dimensions a grid does not use span [0, 1).
+ */
+struct Tile {
+    int begin[3];
+    int end[3];
+};
+
+class IGridRunnable {
+    public:
+        virtual ~IGridRunnable();
+
+        /*
+          Executes one tile of a grid launch. Tiles never overlap and
+          together cover the grid.
+         */
+        virtual void runTile(const Tile& tile) = 0;
+};
+
+/*
+  A bulk task launch whose tasks fold their results into one partial
+  result per worker, which the task system then combines. The typed
+  Reduction<T> in reduction.h implements the partials on top of this.
+ */
+class IReduction {
+    public:
+        virtual ~IReduction();
+
+        /*
+          Prepares num_workers partial results, each set to the
+          identity of the combine operation.
+         */
+        virtual void preparePartials(int num_workers) = 0;
+
+        /*
+          Executes task task_id of num_total_tasks, folding its result
+          into partial result `worker`. Only one thread at a time uses
+          a given partial.
+         */
+        virtual void runTask(int task_id, int num_total_tasks, int worker) = 0;
+
+        /*
+          Folds partial result `from` into partial result `into`.
+         */
+        virtual void combinePartials(int into, int from) = 0;
+
+        /*
+          Whether combining is worth running in parallel, as a tree of
+          log2(num_workers) rounds, rather than on the calling thread.
+          False by default, which suits scalar results.
+         */
+        virtual bool parallelCombine();
+};
+
+// A captured graph of bulk task launches, see task_graph.h
+class TaskGraph;
+
+/*
+  Dependency of each task of a bulk task launch on a range of the tasks
+  of an earlier launch rather than on all of it: task i waits only for
+  tasks [i * stride + begin, i * stride + end) of launch id, clipped to
+  that launch. {id, 1, 0, 1} is one-to-one, {id, 1, -1, 2} adds a halo
+  of one task on each side and {id, k, 0, k} gathers blocks of k tasks.
+  stride must be at least 1; other values make it a dependency on the
+  whole launch.
+ */
+struct SubTaskDep {
+    TaskID id;
+    int stride;
+    int begin;
+    int end;
+};
+
+/*
+  A set of bulk task launches, issued with runAsyncInGroup(), that can
+  be waited for without waiting for any other launch. Owned by the
+  caller; it must outlive its launches, and may be reused once they
+  are complete.
+ */
+class TaskGroup {
+    public:
+        TaskGroup() : num_outstanding(0) {}
+
+        // launches of the group not yet complete, kept by the task system
+        std::atomic<int> num_outstanding;
 };
 
 class ITaskSystem {
@@ -40,6 +169,25 @@ class ITaskSystem {
         */
         virtual void run(IRunnable* runnable, int num_total_tasks) = 0;
 
+        /*
+          Executes a bulk task launch of num_total_tasks that reduces
+          into per-worker partial results, then combines the partials
+          into partial 0. Synchronous like run(); the partials may only
+          be read once runReduce() returns. Threads outside the task
+          system share one partial, so those running tasks of the
+          launch, the caller included, run them one at a time.
+        */
+        void runReduce(IReduction* reduction, int num_total_tasks);
+
+        /*
+          Executes a launch over a 1D, 2D or 3D grid of size[0] x
+          size[1] x size[2] indices (1 for unused dimensions), split
+          into tiles of tile_size[0] x tile_size[1] x tile_size[2]
+          that are issued in the given order. Synchronous like run().
+        */
+        void runGrid(IGridRunnable* runnable, const int size[3], const int tile_size[3],
+                     TileOrder order = TILE_ORDER_HILBERT);
+
         /*
           Executes an asynchronous bulk task launch of
           num_total_tasks, but with a dependency on prior launched
@@ -61,10 +209,157 @@ class ITaskSystem {
         virtual TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                         const std::vector<TaskID>& deps) = 0;
 
+        /*
+          Like runAsyncWithDeps(), with further dependencies that only
+          hold back the tasks mapped onto unfinished tasks of the
+          dependency, so a chain of such launches runs as a wavefront
+          instead of one launch at a time. Task systems that do not
+          override it treat them as dependencies on whole launches.
+         */
+        virtual TaskID runAsyncWithSubTaskDeps(IRunnable* runnable, int num_total_tasks,
+                                               const std::vector<TaskID>& deps,
+                                               const std::vector<SubTaskDep>& sub_task_deps);
+
+        /*
+          Like runAsyncWithDeps(), but also adds the launch to `group`,
+          so that waitGroup() covers it. Launches of a group may depend
+          on launches of any group.
+         */
+        virtual TaskID runAsyncInGroup(TaskGroup* group, IRunnable* runnable, int num_total_tasks,
+                                       const std::vector<TaskID>& deps);
+
+        /*
+          Executes every bulk task launch of a captured graph
+          asynchronously, as the runAsyncWithDeps() calls it recorded
+          would, except that dependencies are already resolved. The
+          launches that depend on no other launch of the graph depend
+          on deps instead. Returns the TaskID of the graph's first
+          launch, or -1 for an empty graph; the i-th launch captured
+          gets that TaskID plus i. The caller must invoke sync() to
+          guarantee their completion. The graph may be replayed any
+          number of times.
+         */
+        virtual TaskID replay(const TaskGraph& graph, const std::vector<TaskID>& deps);
+
         /*
           Blocks until all tasks created as a result of **any prior**
           runXXX calls are done.
          */
         virtual void sync() = 0;
+
+        /*
+          Blocks until the bulk task launch task_id, returned by an
+          earlier runAsyncWithDeps() call, is complete.
+
+          Unlike sync(), wait() may be called from inside runTask():
+          a running task can issue child bulk task launches with
+          runAsyncWithDeps() and wait() on them. A waiting task runs
+          other ready tasks in the meantime instead of blocking a
+          worker; a thread outside the task system only runs tasks of
+          the launch it waits for, so that it is not held up by other
+          requests' work. Task systems that do not override wait() fall
+          back to sync(), so they only support this if their launches
+          complete before runAsyncWithDeps() returns.
+         */
+        virtual void wait(TaskID task_id);
+
+        /*
+          Blocks until every launch issued into `group` so far is
+          complete, leaving the launches of other groups running. A
+          thread outside the task system runs ready tasks of the group
+          meanwhile, but no others, so independent callers sharing the
+          task system do not wait for each other's work; a running task
+          helps with any ready task, as in wait(). Such outside threads
+          share one worker id, so runnables of groups waited for from
+          several threads at once must not use per-worker state. Task
+          systems that do not override it fall back to sync().
+         */
+        virtual void waitGroup(TaskGroup* group);
+
+        /*
+          Cancels the bulk task launch task_id: its tasks that no
+          worker has started yet are dropped, and every launch that
+          depends on it, directly or not, is cancelled as well.
+          Dropped launches still count as complete for wait(), sync()
+          and dependencies. Tasks already running finish normally.
+          Task systems whose launches complete inside
+          runAsyncWithDeps() have nothing left to cancel.
+         */
+        virtual void cancel(TaskID task_id);
+
+        /*
+          Cancels the bulk task launch task_id, as cancel() does, if
+          it has not completed within `seconds` from now.
+         */
+        virtual void setDeadline(TaskID task_id, double seconds);
+
+        /*
+          Attaches a continuation to the bulk task launch task_id: the
+          thread that completes the launch's last task runs
+          continuation->runTask(0, 1) inline, without a round-trip
+          through the task queue, even if the launch was cancelled.
+          The launch only counts as complete for wait(), sync() and
+          dependent launches once its continuations have run. Meant
+          for small follow-up work such as bookkeeping or signalling;
+          it may issue launches but should not wait for any. If the
+          launch is complete already, the calling thread runs it right
+          away. Task systems that do not override it wait() for the
+          launch first.
+         */
+        virtual void addContinuation(TaskID task_id, IRunnable* continuation);
+
+        /*
+          Selects how bulk task launches issued after this call are
+          split into chunks of task ids. Task systems without workers
+          ignore it. Until it is called, each task system uses its own
+          default: GRAIN_FIXED with a grain_size of 1, except that the
+          work-stealing pool splits ranges no finer than 1/8 of each
+          thread's share of a launch.
+         */
+        void setGrainPolicy(GrainPolicy policy, int grain_size);
+
+        /*
+          Number of worker ids of the task system: one per thread it
+          may start, plus one shared by every other thread.
+         */
+        int numWorkers();
+
+        /*
+          Id of the calling thread, between 0 and numWorkers()-1. A
+          thread of the task system keeps its id for the lifetime of
+          the task system; any other thread, such as the one calling
+          run() or sync(), gets numWorkers()-1. Runnables can index
+          per-worker state with it, e.g. a WorkerLocal (scratch.h).
+          Outside threads share their id, and one that waits may run
+          tasks of another's launch, so state indexed by it must not be
+          used from several outside threads at once.
+         */
+        int workerId();
+
+        /*
+          Returns the ScratchArena of the calling thread, for
+          temporaries of runTask() that should not hit the heap. Every
+          thread of the task system has one, and so does every other
+          thread that calls scratch(). Its memory is cache-line aligned
+          and stays valid until the runTask() call that took it
+          returns: when a thread is done with the tasks it claimed
+          together, the task system frees what it took from its arena
+          meanwhile, leaving alone what tasks further up its stack
+          (such as one in wait()) took. Memory taken outside any task
+          is kept. A ScratchScope frees it earlier.
+         */
+        ScratchArena* scratch();
+
+    protected:
+        GrainPolicy grain_policy;
+        int grain_size;
+        // whether setGrainPolicy() was called
+        bool grain_policy_set;
+        int num_workers;
+        // one arena per thread of the task system
+        ScratchArena *scratch_arenas;
+        // arenas of the other threads that called scratch()
+        struct OutsideScratch;
+        OutsideScratch *outside_scratch;
 };
 #endif
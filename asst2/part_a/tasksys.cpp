@@ -1,12 +1,289 @@
 #include "tasksys.h"
+#include "env.h"
+#include "tile_order.h"
+#include "task_graph.h"
+#include <algorithm>
 #include <thread>
 
 // https://www.youtube.com/watch?v=6re5U82KwbY
 
 IRunnable::~IRunnable() {}
 
-ITaskSystem::ITaskSystem(int num_threads) {}
-ITaskSystem::~ITaskSystem() {}
+bool IRunnable::fusable() {
+    return false;
+}
+
+IGridRunnable::~IGridRunnable() {}
+
+IReduction::~IReduction() {}
+
+bool IReduction::parallelCombine() {
+    return false;
+}
+
+/*
+ * Arenas of the threads outside the task system, created on their first
+ * scratch() call and kept until the task system is destroyed
+ */
+struct ITaskSystem::OutsideScratch {
+    std::mutex mutex;
+    std::vector<std::pair<std::thread::id, ScratchArena*> > arenas;
+
+    ~OutsideScratch() {
+        for (auto &entry : this->arenas) delete entry.second;
+    }
+
+    ScratchArena* find() {
+        std::thread::id self = std::this_thread::get_id();
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for (auto &entry : this->arenas) {
+            if (entry.first == self) return entry.second;
+        }
+        this->arenas.push_back(std::make_pair(self, new ScratchArena));
+        return this->arenas.back().second;
+    }
+};
+
+ITaskSystem::ITaskSystem(int num_threads) {
+    this->grain_policy = GRAIN_FIXED;
+    this->grain_size = 1;
+    this->grain_policy_set = false;
+    this->num_workers = num_threads + 1;
+    this->scratch_arenas = new ScratchArena[num_threads];
+    this->outside_scratch = new OutsideScratch;
+}
+ITaskSystem::~ITaskSystem() {
+    delete[] this->scratch_arenas;
+    delete this->outside_scratch;
+}
+
+void ITaskSystem::setGrainPolicy(GrainPolicy policy, int grain_size) {
+    this->grain_policy = policy;
+    this->grain_size = grain_size;
+    this->grain_policy_set = true;
+}
+
+void ITaskSystem::wait(TaskID task_id) {
+    this->sync();
+}
+
+TaskID ITaskSystem::runAsyncWithSubTaskDeps(IRunnable* runnable, int num_total_tasks,
+                                            const std::vector<TaskID>& deps,
+                                            const std::vector<SubTaskDep>& sub_task_deps) {
+    std::vector<TaskID> all_deps(deps);
+    for (const SubTaskDep &sub_task_dep : sub_task_deps) all_deps.push_back(sub_task_dep.id);
+    return this->runAsyncWithDeps(runnable, num_total_tasks, all_deps);
+}
+
+TaskID ITaskSystem::runAsyncInGroup(TaskGroup* group, IRunnable* runnable, int num_total_tasks,
+                                    const std::vector<TaskID>& deps) {
+    return this->runAsyncWithDeps(runnable, num_total_tasks, deps);
+}
+
+void ITaskSystem::waitGroup(TaskGroup* group) {
+    this->sync();
+}
+
+void ITaskSystem::addContinuation(TaskID task_id, IRunnable* continuation) {
+    this->wait(task_id);
+    continuation->runTask(0, 1);
+}
+
+TaskID ITaskSystem::replay(const TaskGraph& graph, const std::vector<TaskID>& deps) {
+    // capture order is topological, so each launch's deps are known by now
+    std::vector<TaskID> ids(graph.size());
+    std::vector<TaskID> launch_deps;
+    for (int i = 0; i < graph.size(); i++) {
+        if (graph.numDeps(i) == 0) launch_deps = deps;
+        else launch_deps.clear();
+        for (int j = 0; j < graph.numDeps(i); j++) launch_deps.push_back(ids[graph.deps(i)[j]]);
+        const TaskGraph::Node &node = graph.node(i);
+        ids[i] = this->runAsyncWithDeps(node.runnable, node.num_total_tasks, launch_deps);
+    }
+    return ids.empty() ? -1 : ids[0];
+}
+
+void ITaskSystem::cancel(TaskID task_id) {
+}
+
+void ITaskSystem::setDeadline(TaskID task_id, double seconds) {
+}
+
+// Which worker of which task system the current thread is, set at the
+// start of each worker's threadFunc(); any other thread is worker -1
+static thread_local const ITaskSystem *worker_system = nullptr;
+static thread_local int worker_id = -1;
+
+static void setCurrentWorker(const ITaskSystem *system, int thread_id) {
+    worker_system = system;
+    worker_id = thread_id;
+}
+
+static int currentWorker(const ITaskSystem *system) {
+    return worker_system == system ? worker_id : -1;
+}
+
+int ITaskSystem::numWorkers() {
+    return this->num_workers;
+}
+
+int ITaskSystem::workerId() {
+    int thread_id = currentWorker(this);
+    return thread_id < 0 ? this->num_workers - 1 : thread_id;
+}
+
+// Where an arena stood when the tasks the current thread runs at
+// nesting level depth first took memory from it
+struct ScratchFrame {
+    ScratchArena *arena;
+    ScratchArena::Mark mark;
+    int depth;
+};
+
+// How many TaskFrames the current thread is inside, and the arenas its
+// tasks took memory from at each level, innermost last
+static thread_local int task_depth = 0;
+static thread_local std::vector<ScratchFrame> scratch_frames;
+
+/*
+ * TaskFrame: held by a thread while it runs tasks it claimed together.
+ * Once they are done, the arenas they took memory from are rewound to
+ * where they stood, and reset if they were empty, which also merges
+ * their blocks.
+ */
+class TaskFrame {
+    public:
+        TaskFrame() { task_depth++; }
+        ~TaskFrame() {
+            while (!scratch_frames.empty() && scratch_frames.back().depth == task_depth) {
+                ScratchFrame &frame = scratch_frames.back();
+                if (frame.mark.block == 0 && frame.mark.used == 0) frame.arena->reset();
+                else frame.arena->release(frame.mark);
+                scratch_frames.pop_back();
+            }
+            task_depth--;
+        }
+};
+
+ScratchArena* ITaskSystem::scratch() {
+    int thread_id = currentWorker(this);
+    ScratchArena *arena = thread_id >= 0 ? &this->scratch_arenas[thread_id] : this->outside_scratch->find();
+    if (task_depth == 0) return arena;
+    for (int i = (int)scratch_frames.size() - 1; i >= 0 && scratch_frames[i].depth == task_depth; i--) {
+        if (scratch_frames[i].arena == arena) return arena;
+    }
+    ScratchFrame frame = {arena, arena->mark(), task_depth};
+    scratch_frames.push_back(frame);
+    return arena;
+}
+
+/*
+ * Runs the tasks of a reduction, each into the partial of the worker
+ * that runs it. Threads outside the task system share the last partial,
+ * and any number of them may help with the launch, so they take turns.
+ */
+class ReduceTasks: public IRunnable {
+    public:
+        ReduceTasks(ITaskSystem *system, IReduction *reduction)
+            : system(system), reduction(reduction) {}
+        void runTask(int task_id, int num_total_tasks) {
+            int worker = this->system->workerId();
+            if (worker < this->system->numWorkers() - 1) {
+                this->reduction->runTask(task_id, num_total_tasks, worker);
+                return;
+            }
+            std::lock_guard<std::mutex> lock(this->outside_mutex);
+            this->reduction->runTask(task_id, num_total_tasks, worker);
+        }
+    private:
+        ITaskSystem *system;
+        IReduction *reduction;
+        std::mutex outside_mutex;
+};
+
+/*
+ * One round of a tree combine: task i folds partial i * 2 * stride + stride
+ * into partial i * 2 * stride
+ */
+class CombineRound: public IRunnable {
+    public:
+        CombineRound(IReduction *reduction, int num_partials, int stride)
+            : reduction(reduction), num_partials(num_partials), stride(stride) {}
+        void runTask(int task_id, int num_total_tasks) {
+            int into = task_id * 2 * this->stride;
+            if (into + this->stride < this->num_partials) {
+                this->reduction->combinePartials(into, into + this->stride);
+            }
+        }
+    private:
+        IReduction *reduction;
+        int num_partials;
+        int stride;
+};
+
+void ITaskSystem::runReduce(IReduction* reduction, int num_total_tasks) {
+    reduction->preparePartials(this->num_workers);
+    ReduceTasks tasks(this, reduction);
+    this->run(&tasks, num_total_tasks);
+
+    if (!reduction->parallelCombine()) {
+        for (int i = 1; i < this->num_workers; i++) reduction->combinePartials(0, i);
+        return;
+    }
+    for (int stride = 1; stride < this->num_workers; stride *= 2) {
+        CombineRound round(reduction, this->num_workers, stride);
+        int num_pairs = (this->num_workers + 2 * stride - 1) / (2 * stride);
+        this->run(&round, num_pairs);
+    }
+}
+
+/*
+ * Runs the tiles of a grid launch, task i being the i-th tile in the
+ * launch's tile order
+ */
+class GridTasks: public IRunnable {
+    public:
+        GridTasks(IGridRunnable *runnable, const int size[3], const int tile_size[3],
+                  const int num_tiles[3], const std::vector<int> &tiles)
+            : runnable(runnable), size(size), tile_size(tile_size), num_tiles(num_tiles), tiles(tiles) {}
+        void runTask(int task_id, int num_total_tasks) {
+            int index = this->tiles[task_id];
+            int coords[3] = {
+                index % this->num_tiles[0],
+                (index / this->num_tiles[0]) % this->num_tiles[1],
+                index / (this->num_tiles[0] * this->num_tiles[1]),
+            };
+            Tile tile;
+            for (int d = 0; d < 3; d++) {
+                tile.begin[d] = coords[d] * this->tile_size[d];
+                tile.end[d] = std::min(tile.begin[d] + this->tile_size[d], this->size[d]);
+            }
+            this->runnable->runTile(tile);
+        }
+    private:
+        IGridRunnable *runnable;
+        const int *size;
+        const int *tile_size;
+        const int *num_tiles;
+        const std::vector<int> &tiles;
+};
+
+void ITaskSystem::runGrid(IGridRunnable* runnable, const int size[3], const int tile_size[3],
+                          TileOrder order) {
+    int sizes[3], tile_sizes[3], num_tiles[3];
+    int dims = 1;
+    for (int d = 0; d < 3; d++) {
+        sizes[d] = std::max(0, size[d]);
+        tile_sizes[d] = std::max(1, std::min(tile_size[d], sizes[d]));
+        num_tiles[d] = (sizes[d] + tile_sizes[d] - 1) / tile_sizes[d];
+        if (num_tiles[d] > 1) dims = d + 1;
+    }
+    if (num_tiles[0] * num_tiles[1] * num_tiles[2] == 0) return;
+
+    std::vector<int> tiles = tileOrder(num_tiles, dims, order);
+    GridTasks tasks(runnable, sizes, tile_sizes, num_tiles, tiles);
+    this->run(&tasks, (int)tiles.size());
+}
 
 /*
  * ================================================================
@@ -25,6 +302,7 @@ TaskSystemSerial::~TaskSystemSerial() {}
 
 void TaskSystemSerial::run(IRunnable* runnable, int num_total_tasks) {
     for (int i = 0; i < num_total_tasks; i++) {
+        TaskFrame frame;
         runnable->runTask(i, num_total_tasks);
     }
 }
@@ -60,6 +338,7 @@ TaskSystemParallelSpawn::TaskSystemParallelSpawn(int num_threads): ITaskSystem(n
     // (requiring changes to tasksys.h).
     //
     this->num_threads = num_threads;
+    this->caller_helps = envFlag("TASKSYS_SYNC_HELP", true);
     this->threads = new std::thread[num_threads];
 }
 
@@ -67,16 +346,20 @@ TaskSystemParallelSpawn::~TaskSystemParallelSpawn() {
     delete[] this->threads;
 }
 
-void TaskSystemParallelSpawn::threadFunc(IRunnable* runnable, int num_total_tasks, std::mutex* mutex, int* counter) {
+void TaskSystemParallelSpawn::threadFunc(int thread_id, IRunnable* runnable, int num_total_tasks, std::mutex* mutex,
+                                         int* counter, GrainSchedule* schedule) {
+    if (thread_id >= 0) setCurrentWorker(this, thread_id);
     while (true) {
         mutex->lock();
-        int task_id = *counter;
-        *counter += 1;
+        int begin = *counter;
+        int end = std::min(num_total_tasks, begin + schedule->chunk(num_total_tasks - begin));
+        *counter = std::max(begin, end);
         mutex->unlock();
-        if (task_id >= num_total_tasks) {
+        if (begin >= num_total_tasks) {
             break;
         }
-        runnable->runTask(task_id, num_total_tasks);
+        TaskFrame frame;
+        schedule->run(runnable, begin, end, num_total_tasks);
     }
 }
 
@@ -88,9 +371,17 @@ void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
     //  
     std::mutex *mutex = new std::mutex();
     int *counter = new int(0);
+    GrainSchedule schedule;
+    schedule.configure(this->grain_policy, this->grain_size, this->num_threads + this->caller_helps);
 
     for (int i = 0; i < this->num_threads; i++) {
-        this->threads[i] = std::thread(&TaskSystemParallelSpawn::threadFunc, this, runnable, num_total_tasks, mutex, counter);
+        this->threads[i] = std::thread(&TaskSystemParallelSpawn::threadFunc, this, i, runnable, num_total_tasks, mutex,
+                                       counter, &schedule);
+        this->placement.pin(this->threads[i], i);
+    }
+    // the calling thread claims tasks alongside the spawned ones
+    if (this->caller_helps) {
+        this->threadFunc(-1, runnable, num_total_tasks, mutex, counter, &schedule);
     }
 
     for (int i = 0; i < this->num_threads; i++) {
@@ -112,6 +403,125 @@ void TaskSystemParallelSpawn::sync() {
     return;
 }
 
+/*
+ * ================================================================
+ * Parallel Spawn Arena Task System Implementation
+ * ================================================================
+ */
+
+const char* TaskSystemParallelSpawnArena::name() {
+    return "Parallel + Spawn Arena";
+}
+
+TaskSystemParallelSpawnArena::TaskSystemParallelSpawnArena(int num_threads): ITaskSystem(num_threads) {
+    this->num_threads = num_threads;
+    this->caller_helps = envFlag("TASKSYS_SYNC_HELP", true);
+    this->runnable = nullptr;
+    this->num_total_tasks = 0;
+    this->next_task = 0;
+    this->generation = 0;
+    this->num_arrived = 0;
+    this->done = false;
+    this->barrier_mutex = new std::mutex();
+    this->start = new std::condition_variable();
+    this->finish = new std::condition_variable();
+
+    this->threads = new std::thread[num_threads];
+    for (int i = 0; i < this->num_threads; i++) {
+        this->threads[i] = std::thread(&TaskSystemParallelSpawnArena::threadFunc, this, i);
+        this->placement.pin(this->threads[i], i);
+    }
+}
+
+TaskSystemParallelSpawnArena::~TaskSystemParallelSpawnArena() {
+    {
+        std::lock_guard<std::mutex> lock(*this->barrier_mutex);
+        this->done = true;
+    }
+    this->start->notify_all();
+    for (int i = 0; i < this->num_threads; i++) {
+        this->threads[i].join();
+    }
+
+    delete[] this->threads;
+    delete this->barrier_mutex;
+    delete this->start;
+    delete this->finish;
+}
+
+void TaskSystemParallelSpawnArena::runChunks() {
+    int num_total_tasks = this->num_total_tasks;
+    while (true) {
+        int begin = this->next_task.load(std::memory_order_relaxed);
+        if (begin >= num_total_tasks) break;
+        int chunk = this->schedule.chunk(num_total_tasks - begin);
+        begin = this->next_task.fetch_add(chunk, std::memory_order_relaxed);
+        if (begin >= num_total_tasks) break;
+        int end = std::min(begin + chunk, num_total_tasks);
+        TaskFrame frame;
+        this->schedule.run(this->runnable, begin, end, num_total_tasks);
+    }
+}
+
+void TaskSystemParallelSpawnArena::threadFunc(int thread_id) {
+    setCurrentWorker(this, thread_id);
+    long seen_generation = 0;
+    while (true) {
+        // start barrier: park until run() releases the arena
+        {
+            std::unique_lock<std::mutex> lock(*this->barrier_mutex);
+            this->start->wait(lock, [this, &seen_generation] {
+                return this->done || this->generation != seen_generation;
+            });
+            if (this->done) break;
+            seen_generation = this->generation;
+        }
+
+        this->runChunks();
+
+        // finish barrier: the last thread to arrive lets run() return
+        std::lock_guard<std::mutex> lock(*this->barrier_mutex);
+        if (++this->num_arrived == this->num_threads) {
+            this->finish->notify_one();
+        }
+    }
+}
+
+void TaskSystemParallelSpawnArena::run(IRunnable* runnable, int num_total_tasks) {
+    // every thread passed the finish barrier of the previous run(), so
+    // nobody reads the launch while it is replaced
+    this->schedule.configure(this->grain_policy, this->grain_size, this->num_threads + this->caller_helps);
+    this->runnable = runnable;
+    this->num_total_tasks = num_total_tasks;
+    this->next_task.store(0, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(*this->barrier_mutex);
+        this->num_arrived = 0;
+        this->generation++;
+    }
+    this->start->notify_all();
+
+    if (this->caller_helps) {
+        this->runChunks();
+    }
+
+    std::unique_lock<std::mutex> lock(*this->barrier_mutex);
+    this->finish->wait(lock, [this] {
+        return this->num_arrived == this->num_threads;
+    });
+}
+
+TaskID TaskSystemParallelSpawnArena::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                                      const std::vector<TaskID>& deps) {
+    // You do not need to implement this method.
+    return 0;
+}
+
+void TaskSystemParallelSpawnArena::sync() {
+    // You do not need to implement this method.
+    return;
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Spinning Task System Implementation
@@ -119,24 +529,77 @@ void TaskSystemParallelSpawn::sync() {
  */
 
 
-Tasks::Tasks()
+Tasks::Tasks(Tracer *tracer)
 {
-    this->mutex = new std::mutex(); 
+    this->tracer = tracer;
+    this->launch_id = -1;
     this->finished_mutex = new std::mutex();
     this->finished = new std::condition_variable();
     this->num_total_tasks = 0;
-    this->num_completed_tasks = 0;
-    this->num_remaining_tasks = 0;
     this->runnable = nullptr;
+    this->next_task = 0;
+    this->num_completed_tasks = 0;
 }
 
 Tasks::~Tasks()
 {
-    delete this->mutex;
     delete this->finished_mutex;
     delete this->finished;
 }
 
+void Tasks::launch(IRunnable* runnable, int num_total_tasks)
+{
+    // the previous launch is complete, so only stale claims can race with
+    // this, and those fail against the new num_total_tasks
+    this->num_total_tasks = num_total_tasks;
+    this->launch_id++;
+    this->num_completed_tasks.store(0, std::memory_order_relaxed);
+    this->runnable.store(runnable, std::memory_order_relaxed);
+    this->next_task.store((long long)num_total_tasks << 32, std::memory_order_release);
+}
+
+bool Tasks::runNext(int thread_id)
+{
+    // cheap check first so idle workers do not keep bumping next_task
+    long long state = this->next_task.load(std::memory_order_acquire);
+    int claimed = (int)(state & 0xffffffff);
+    int total_tasks = (int)(state >> 32);
+    if (claimed >= total_tasks) return false;
+    int chunk = std::min(this->schedule.chunk(total_tasks - claimed), total_tasks - claimed);
+
+    state = this->next_task.fetch_add(chunk, std::memory_order_acquire);
+    int begin = (int)(state & 0xffffffff);
+    total_tasks = (int)(state >> 32);
+    if (begin >= total_tasks) return false;
+    int end = std::min(begin + chunk, total_tasks);
+
+    this->tracer->record(thread_id, TRACE_RUN_BEGIN, this->launch_id, begin, end);
+    TaskFrame frame;
+    this->schedule.run(this->runnable.load(std::memory_order_relaxed), begin, end, total_tasks);
+    this->tracer->record(thread_id, TRACE_RUN_END, this->launch_id, begin, end);
+
+    // only the last finisher wakes up run()
+    if (this->num_completed_tasks.fetch_add(end - begin, std::memory_order_acq_rel) + (end - begin) == total_tasks) {
+        std::lock_guard<std::mutex> lock(*this->finished_mutex);
+        this->finished->notify_all();
+    }
+    return true;
+}
+
+bool Tasks::hasWork()
+{
+    long long state = this->next_task.load(std::memory_order_relaxed);
+    return (int)(state & 0xffffffff) < (int)(state >> 32);
+}
+
+void Tasks::wait()
+{
+    std::unique_lock<std::mutex> lock(*this->finished_mutex);
+    this->finished->wait(lock, [this] {
+        return this->num_completed_tasks.load(std::memory_order_acquire) == this->num_total_tasks;
+    });
+}
+
 const char* TaskSystemParallelThreadPoolSpinning::name() {
     return "Parallel + Thread Pool + Spin";
 }
@@ -148,13 +611,16 @@ TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(int n
     // Implementations are free to add new class member variables
     // (requiring changes to tasksys.h).
     //
-    this->tasks = new Tasks();
+    this->tracer = new Tracer("spin", num_threads);
+    this->tasks = new Tasks(this->tracer);
     this->num_threads = num_threads;
+    this->caller_helps = envFlag("TASKSYS_SYNC_HELP", true);
     this->threads = new std::thread[num_threads];
     this->done = false;
 
     for (int i = 0; i < this->num_threads; i++) {
-        this->threads[i] = std::thread(&TaskSystemParallelThreadPoolSpinning::threadFunc, this);
+        this->threads[i] = std::thread(&TaskSystemParallelThreadPoolSpinning::threadFunc, this, i);
+        this->placement.pin(this->threads[i], i);
     }
 }
 
@@ -164,40 +630,17 @@ TaskSystemParallelThreadPoolSpinning::~TaskSystemParallelThreadPoolSpinning() {
         this->threads[i].join();
     }
 
+    this->tracer->dump();
     delete this->tasks;
     delete[] this->threads;
+    delete this->tracer;
 }
 
-void TaskSystemParallelThreadPoolSpinning::threadFunc() {
-    int total_tasks;
-    int task_id;
+void TaskSystemParallelThreadPoolSpinning::threadFunc(int thread_id) {
+    setCurrentWorker(this, thread_id);
     // Spinning thread
     while (!this->done) {
-        // Check if there are tasks to run
-        this->tasks->mutex->lock();
-        total_tasks = this->tasks->num_total_tasks;
-        task_id = total_tasks - this->tasks->num_remaining_tasks;
-        
-        if (task_id < total_tasks) {
-            this->tasks->num_remaining_tasks--;
-            this->tasks->mutex->unlock();
-
-            tasks->runnable->runTask(task_id, total_tasks);
-            this->tasks->mutex->lock();
-            this->tasks->num_completed_tasks++;
-            if (this->tasks->num_completed_tasks == total_tasks) {
-                this->tasks->mutex->unlock();
-                this->tasks->finished_mutex->lock();
-                this->tasks->finished_mutex->unlock();
-                this->tasks->finished->notify_all();
-            }
-            else {
-                this->tasks->mutex->unlock();
-            }
-        } 
-        else {
-            this->tasks->mutex->unlock();
-        }
+        this->tasks->runNext(thread_id);
     }
 }
 
@@ -209,15 +652,17 @@ void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable, int num_tota
     // method in Part A.  The implementation provided below runs all
     // tasks sequentially on the calling thread.
     //
-    std::unique_lock<std::mutex> lock(*(this->tasks->finished_mutex));
-    this->tasks->mutex->lock();
-    this->tasks->num_completed_tasks = 0;
-    this->tasks->num_total_tasks = num_total_tasks;
-    this->tasks->num_remaining_tasks = num_total_tasks;
-    this->tasks->runnable = runnable;
-    this->tasks->mutex->unlock();
-    this->tasks->finished->wait(lock);
-    lock.unlock();
+    this->tasks->schedule.configure(this->grain_policy, this->grain_size, this->num_threads + this->caller_helps);
+    this->tasks->launch(runnable, num_total_tasks);
+    this->tracer->record(-1, TRACE_LAUNCH, this->tasks->launch_id, 0, num_total_tasks);
+
+    // run subtasks on the calling thread instead of idling until the end
+    if (this->caller_helps) {
+        while (this->tasks->runNext(-1));
+    }
+    this->tracer->record(-1, TRACE_PARK, -1);
+    this->tasks->wait();
+    this->tracer->record(-1, TRACE_UNPARK, -1);
 }
 
 TaskID TaskSystemParallelThreadPoolSpinning::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
@@ -248,15 +693,20 @@ TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(int n
     // Implementations are free to add new class member variables
     // (requiring changes to tasksys.h).
     //
-    this->tasks = new Tasks();
+    this->tracer = new Tracer("sleep", num_threads);
+    this->tasks = new Tasks(this->tracer);
     this->num_threads = num_threads;
+    this->caller_helps = envFlag("TASKSYS_SYNC_HELP", true);
     this->threads = new std::thread[num_threads];
     this->done = false;
+    this->launch_epoch = 0;
+    this->num_parked = 0;
     this->has_tasks_mutex = new std::mutex();
     this->has_tasks = new std::condition_variable();
 
     for (int i = 0; i < this->num_threads; i++) {
-        this->threads[i] = std::thread(&TaskSystemParallelThreadPoolSleeping::threadFunc, this);
+        this->threads[i] = std::thread(&TaskSystemParallelThreadPoolSleeping::threadFunc, this, i);
+        this->placement.pin(this->threads[i], i);
     }
 }
 
@@ -267,49 +717,44 @@ TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
     // Implementations are free to add new class member variables
     // (requiring changes to tasksys.h).
     //
-    this->done = true;
+    {
+        std::lock_guard<std::mutex> lock(*(this->has_tasks_mutex));
+        this->done = true;
+    }
     this->has_tasks->notify_all();
     for (int i = 0; i < this->num_threads; i++) this->threads[i].join();
 
+    this->tracer->dump();
     delete this->tasks;
     delete[] this->threads;
     delete this->has_tasks_mutex;
     delete this->has_tasks;
+    delete this->tracer;
 }
 
-void TaskSystemParallelThreadPoolSleeping::threadFunc() {
-    int total_tasks;
-    int task_id;
-    // Spinning thread
-    while (!this->done) {
-        // Check if there are tasks to run
-        this->tasks->mutex->lock();
-        total_tasks = this->tasks->num_total_tasks;
-        task_id = total_tasks - this->tasks->num_remaining_tasks;
-        
-        if (task_id < total_tasks) {
-            this->tasks->num_remaining_tasks--;
-            this->tasks->mutex->unlock();
-            
-            tasks->runnable->runTask(task_id, total_tasks);
-            this->tasks->mutex->lock();
-            this->tasks->num_completed_tasks++;
-            if (this->tasks->num_completed_tasks == total_tasks) {
-                this->tasks->mutex->unlock();
-                this->tasks->finished_mutex->lock();
-                this->tasks->finished_mutex->unlock();
-                this->tasks->finished->notify_all();
-            }
-            else {
-                this->tasks->mutex->unlock();
-            }
-        } 
-        else {
-            this->tasks->mutex->unlock();
-            std::unique_lock<std::mutex> lock(*(this->has_tasks_mutex));
-            this->has_tasks->wait(lock);
-            lock.unlock();
+void TaskSystemParallelThreadPoolSleeping::threadFunc(int thread_id) {
+    setCurrentWorker(this, thread_id);
+    long seen_epoch = 0;
+    while (true) {
+        if (this->tasks->runNext(thread_id)) continue;
+
+        // Out of work: spin, then yield, in case another run() follows shortly
+        if (this->idle.wait([this] { return this->done || this->tasks->hasWork(); })) {
+            if (this->done) break;
+            continue;
         }
+
+        // then sleep until the next run() or shutdown
+        std::unique_lock<std::mutex> lock(*(this->has_tasks_mutex));
+        this->num_parked++;
+        this->tracer->record(thread_id, TRACE_PARK, -1);
+        this->has_tasks->wait(lock, [this, &seen_epoch] {
+            return this->done || this->launch_epoch != seen_epoch;
+        });
+        this->tracer->record(thread_id, TRACE_UNPARK, -1);
+        this->num_parked--;
+        if (this->done) break;
+        seen_epoch = this->launch_epoch;
     }
 }
 
@@ -321,16 +766,33 @@ void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable, int num_tota
     // tasks sequentially on the calling thread.
     //
 
-    std::unique_lock<std::mutex> lock(*(this->tasks->finished_mutex));
-    this->tasks->mutex->lock();
-    this->tasks->num_completed_tasks = 0;
-    this->tasks->num_total_tasks = num_total_tasks;
-    this->tasks->num_remaining_tasks = num_total_tasks;
-    this->tasks->runnable = runnable;
-    this->tasks->mutex->unlock();
-    this->has_tasks->notify_all();
-    this->tasks->finished->wait(lock);
-    lock.unlock();
+    this->tasks->schedule.configure(this->grain_policy, this->grain_size, this->num_threads + this->caller_helps);
+    this->tasks->launch(runnable, num_total_tasks);
+    this->tracer->record(-1, TRACE_LAUNCH, this->tasks->launch_id, 0, num_total_tasks);
+
+    // Spinning workers pick the launch up by themselves, so only wake as
+    // many parked workers as there are chunks to hand out, minus the one
+    // the calling thread takes
+    int chunk = this->tasks->schedule.chunk(num_total_tasks);
+    int num_chunks = (num_total_tasks + chunk - 1) / chunk - this->caller_helps;
+    int num_wake;
+    {
+        std::lock_guard<std::mutex> lock(*(this->has_tasks_mutex));
+        this->launch_epoch++;
+        num_wake = std::min(num_chunks, this->num_parked);
+    }
+    if (num_wake == this->num_threads) {
+        this->has_tasks->notify_all();
+    } else {
+        for (int i = 0; i < num_wake; i++) this->has_tasks->notify_one();
+    }
+
+    if (this->caller_helps) {
+        while (this->tasks->runNext(-1));
+    }
+    this->tracer->record(-1, TRACE_PARK, -1);
+    this->tasks->wait();
+    this->tracer->record(-1, TRACE_UNPARK, -1);
 }
 
 TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
@@ -352,3 +814,39 @@ void TaskSystemParallelThreadPoolSleeping::sync() {
 
     return;
 }
+
+
+/*
+ * ================================================================
+ * Parallel Thread Pool Work-Stealing Task System Implementation
+ * ================================================================
+ */
+
+const char* TaskSystemParallelThreadPoolStealing::name() {
+    return "Parallel + Thread Pool + Steal";
+}
+
+TaskSystemParallelThreadPoolStealing::TaskSystemParallelThreadPoolStealing(int num_threads): ITaskSystem(num_threads) {
+    // NOTE: TaskSystemParallelThreadPoolStealing is only implemented in Part B.
+}
+
+TaskSystemParallelThreadPoolStealing::~TaskSystemParallelThreadPoolStealing() {}
+
+void TaskSystemParallelThreadPoolStealing::run(IRunnable* runnable, int num_total_tasks) {
+    // NOTE: TaskSystemParallelThreadPoolStealing is only implemented in Part B.
+    for (int i = 0; i < num_total_tasks; i++) {
+        TaskFrame frame;
+        runnable->runTask(i, num_total_tasks);
+    }
+}
+
+TaskID TaskSystemParallelThreadPoolStealing::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                                              const std::vector<TaskID>& deps) {
+    // You do not need to implement this method.
+    return 0;
+}
+
+void TaskSystemParallelThreadPoolStealing::sync() {
+    // You do not need to implement this method.
+    return;
+}
@@ -2,6 +2,11 @@
 #define _TASKSYS_H
 
 #include "itasksys.h"
+#include "grain.h"
+#include "placement.h"
+#include "idle.h"
+#include "trace.h"
+#include <atomic>
 #include <mutex>
 #include <thread>
 #include <condition_variable>
@@ -23,17 +28,36 @@ class TaskSystemSerial: public ITaskSystem {
         void sync();
 };
 
+/*
+ * Tasks: the current bulk task launch of a thread pool. Subtasks are
+ * claimed with a single fetch_add on next_task, which packs the launch's
+ * num_total_tasks in its upper half and the next task id in its lower
+ * half, so a claim can never be mistaken for one of another launch.
+ * A claim takes a chunk of ids sized by the GrainSchedule. Each counter
+ * sits on its own cache line.
+ */
 class Tasks {
     public:
-        Tasks();
+        Tasks(Tracer *tracer);
         ~Tasks();
-        IRunnable *runnable;
+        void launch(IRunnable* runnable, int num_total_tasks);
+        bool runNext(int thread_id);
+        bool hasWork();
+        void wait();
         int num_total_tasks;
-        int num_completed_tasks;
-        int num_remaining_tasks;
-        std::mutex *mutex;
+        // number of the current launch, for tracing
+        int launch_id;
+        Tracer *tracer;
+        std::atomic<IRunnable*> runnable;
+        GrainSchedule schedule;
         std::mutex *finished_mutex;
         std::condition_variable *finished;
+    private:
+        char pad0[CACHE_LINE_SIZE];
+        std::atomic<long long> next_task;
+        char pad1[CACHE_LINE_SIZE];
+        std::atomic<int> num_completed_tasks;
+        char pad2[CACHE_LINE_SIZE];
 };
 
 /*
@@ -53,8 +77,51 @@ class TaskSystemParallelSpawn: public ITaskSystem {
         void sync();
     private:
         int num_threads;
+        // run() executes tasks on the calling thread too
+        bool caller_helps;
+        std::thread *threads;
+        ThreadPlacement placement;
+        void threadFunc(int thread_id, IRunnable* runnable, int num_total_tasks, std::mutex* mutex, int* counter,
+                        GrainSchedule* schedule);
+};
+
+/*
+ * TaskSystemParallelSpawnArena: variant of TaskSystemParallelSpawn that
+ * creates its threads once and parks them between run() calls. run()
+ * releases the whole arena through a start barrier and waits for every
+ * thread at a finish barrier, so each launch still gets fresh workers
+ * with no queue between launches, minus the thread creation and join.
+ */
+class TaskSystemParallelSpawnArena: public ITaskSystem {
+    public:
+        TaskSystemParallelSpawnArena(int num_threads);
+        ~TaskSystemParallelSpawnArena();
+        const char* name();
+        void run(IRunnable* runnable, int num_total_tasks);
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                const std::vector<TaskID>& deps);
+        void sync();
+    private:
+        int num_threads;
+        // run() executes tasks on the calling thread too
+        bool caller_helps;
         std::thread *threads;
-        void threadFunc(IRunnable* runnable, int num_total_tasks, std::mutex* mutex, int* counter);
+        ThreadPlacement placement;
+        // the current launch, only written while the arena is parked
+        IRunnable *runnable;
+        int num_total_tasks;
+        std::atomic<int> next_task;
+        GrainSchedule schedule;
+        // barrier state, guarded by barrier_mutex: run() bumps generation
+        // to release the arena, threads count themselves in num_arrived
+        long generation;
+        int num_arrived;
+        bool done;
+        std::mutex *barrier_mutex;
+        std::condition_variable *start;
+        std::condition_variable *finish;
+        void threadFunc(int thread_id);
+        void runChunks();
 };
 
 /*
@@ -75,9 +142,13 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
     private:
         Tasks *tasks;
         int num_threads;
+        // run() executes tasks on the calling thread too
+        bool caller_helps;
         std::thread *threads;
-        bool done;
-        void threadFunc();
+        ThreadPlacement placement;
+        std::atomic<bool> done;
+        Tracer *tracer;
+        void threadFunc(int thread_id);
 };
 
 /*
@@ -98,11 +169,35 @@ class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
     private:
         Tasks *tasks;
         int num_threads;
+        // run() executes tasks on the calling thread too
+        bool caller_helps;
         std::thread *threads;
-        bool done;
+        ThreadPlacement placement;
+        std::atomic<bool> done;
+        // bumped by every run(), guarded by has_tasks_mutex
+        long launch_epoch;
+        // workers asleep on has_tasks, guarded by has_tasks_mutex
+        int num_parked;
+        IdleBackoff idle;
         std::mutex *has_tasks_mutex;
         std::condition_variable *has_tasks;
-        void threadFunc();
+        Tracer *tracer;
+        void threadFunc(int thread_id);
+};
+
+/*
+ * TaskSystemParallelThreadPoolStealing: work-stealing thread pool. See
+ * part_b for the implementation; it is not implemented in Part A.
+ */
+class TaskSystemParallelThreadPoolStealing: public ITaskSystem {
+    public:
+        TaskSystemParallelThreadPoolStealing(int num_threads);
+        ~TaskSystemParallelThreadPoolStealing();
+        const char* name();
+        void run(IRunnable* runnable, int num_total_tasks);
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                const std::vector<TaskID>& deps);
+        void sync();
 };
 
 #endif
@@ -1,12 +1,289 @@
 #include "tasksys.h"
+#include "env.h"
+#include "tile_order.h"
+#include "task_graph.h"
+#include <algorithm>
 #include <stdio.h>
 #include <iostream> 
 #include <fstream>
 
 IRunnable::~IRunnable() {}
 
-ITaskSystem::ITaskSystem(int num_threads) {}
-ITaskSystem::~ITaskSystem() {}
+bool IRunnable::fusable() {
+    return false;
+}
+
+IGridRunnable::~IGridRunnable() {}
+
+IReduction::~IReduction() {}
+
+bool IReduction::parallelCombine() {
+    return false;
+}
+
+/*
+ * Arenas of the threads outside the task system, created on their first
+ * scratch() call and kept until the task system is destroyed
+ */
+struct ITaskSystem::OutsideScratch {
+    std::mutex mutex;
+    std::vector<std::pair<std::thread::id, ScratchArena*> > arenas;
+
+    ~OutsideScratch() {
+        for (auto &entry : this->arenas) delete entry.second;
+    }
+
+    ScratchArena* find() {
+        std::thread::id self = std::this_thread::get_id();
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for (auto &entry : this->arenas) {
+            if (entry.first == self) return entry.second;
+        }
+        this->arenas.push_back(std::make_pair(self, new ScratchArena));
+        return this->arenas.back().second;
+    }
+};
+
+ITaskSystem::ITaskSystem(int num_threads) {
+    this->grain_policy = GRAIN_FIXED;
+    this->grain_size = 1;
+    this->grain_policy_set = false;
+    this->num_workers = num_threads + 1;
+    this->scratch_arenas = new ScratchArena[num_threads];
+    this->outside_scratch = new OutsideScratch;
+}
+ITaskSystem::~ITaskSystem() {
+    delete[] this->scratch_arenas;
+    delete this->outside_scratch;
+}
+
+void ITaskSystem::setGrainPolicy(GrainPolicy policy, int grain_size) {
+    this->grain_policy = policy;
+    this->grain_size = grain_size;
+    this->grain_policy_set = true;
+}
+
+void ITaskSystem::wait(TaskID task_id) {
+    this->sync();
+}
+
+TaskID ITaskSystem::runAsyncWithSubTaskDeps(IRunnable* runnable, int num_total_tasks,
+                                            const std::vector<TaskID>& deps,
+                                            const std::vector<SubTaskDep>& sub_task_deps) {
+    std::vector<TaskID> all_deps(deps);
+    for (const SubTaskDep &sub_task_dep : sub_task_deps) all_deps.push_back(sub_task_dep.id);
+    return this->runAsyncWithDeps(runnable, num_total_tasks, all_deps);
+}
+
+TaskID ITaskSystem::runAsyncInGroup(TaskGroup* group, IRunnable* runnable, int num_total_tasks,
+                                    const std::vector<TaskID>& deps) {
+    return this->runAsyncWithDeps(runnable, num_total_tasks, deps);
+}
+
+void ITaskSystem::waitGroup(TaskGroup* group) {
+    this->sync();
+}
+
+void ITaskSystem::addContinuation(TaskID task_id, IRunnable* continuation) {
+    this->wait(task_id);
+    continuation->runTask(0, 1);
+}
+
+TaskID ITaskSystem::replay(const TaskGraph& graph, const std::vector<TaskID>& deps) {
+    // capture order is topological, so each launch's deps are known by now
+    std::vector<TaskID> ids(graph.size());
+    std::vector<TaskID> launch_deps;
+    for (int i = 0; i < graph.size(); i++) {
+        if (graph.numDeps(i) == 0) launch_deps = deps;
+        else launch_deps.clear();
+        for (int j = 0; j < graph.numDeps(i); j++) launch_deps.push_back(ids[graph.deps(i)[j]]);
+        const TaskGraph::Node &node = graph.node(i);
+        ids[i] = this->runAsyncWithDeps(node.runnable, node.num_total_tasks, launch_deps);
+    }
+    return ids.empty() ? -1 : ids[0];
+}
+
+void ITaskSystem::cancel(TaskID task_id) {
+}
+
+void ITaskSystem::setDeadline(TaskID task_id, double seconds) {
+}
+
+// Which worker of which task system the current thread is, set at the
+// start of each worker's threadFunc(); any other thread is worker -1
+static thread_local const ITaskSystem *worker_system = nullptr;
+static thread_local int worker_id = -1;
+
+static void setCurrentWorker(const ITaskSystem *system, int thread_id) {
+    worker_system = system;
+    worker_id = thread_id;
+}
+
+static int currentWorker(const ITaskSystem *system) {
+    return worker_system == system ? worker_id : -1;
+}
+
+int ITaskSystem::numWorkers() {
+    return this->num_workers;
+}
+
+int ITaskSystem::workerId() {
+    int thread_id = currentWorker(this);
+    return thread_id < 0 ? this->num_workers - 1 : thread_id;
+}
+
+// Where an arena stood when the tasks the current thread runs at
+// nesting level depth first took memory from it
+struct ScratchFrame {
+    ScratchArena *arena;
+    ScratchArena::Mark mark;
+    int depth;
+};
+
+// How many TaskFrames the current thread is inside, and the arenas its
+// tasks took memory from at each level, innermost last
+static thread_local int task_depth = 0;
+static thread_local std::vector<ScratchFrame> scratch_frames;
+
+/*
+ * TaskFrame: held by a thread while it runs tasks it claimed together.
+ * Once they are done, the arenas they took memory from are rewound to
+ * where they stood, and reset if they were empty, which also merges
+ * their blocks.
+ */
+class TaskFrame {
+    public:
+        TaskFrame() { task_depth++; }
+        ~TaskFrame() {
+            while (!scratch_frames.empty() && scratch_frames.back().depth == task_depth) {
+                ScratchFrame &frame = scratch_frames.back();
+                if (frame.mark.block == 0 && frame.mark.used == 0) frame.arena->reset();
+                else frame.arena->release(frame.mark);
+                scratch_frames.pop_back();
+            }
+            task_depth--;
+        }
+};
+
+ScratchArena* ITaskSystem::scratch() {
+    int thread_id = currentWorker(this);
+    ScratchArena *arena = thread_id >= 0 ? &this->scratch_arenas[thread_id] : this->outside_scratch->find();
+    if (task_depth == 0) return arena;
+    for (int i = (int)scratch_frames.size() - 1; i >= 0 && scratch_frames[i].depth == task_depth; i--) {
+        if (scratch_frames[i].arena == arena) return arena;
+    }
+    ScratchFrame frame = {arena, arena->mark(), task_depth};
+    scratch_frames.push_back(frame);
+    return arena;
+}
+
+/*
+ * Runs the tasks of a reduction, each into the partial of the worker
+ * that runs it. Threads outside the task system share the last partial,
+ * and any number of them may help with the launch, so they take turns.
+ */
+class ReduceTasks: public IRunnable {
+    public:
+        ReduceTasks(ITaskSystem *system, IReduction *reduction)
+            : system(system), reduction(reduction) {}
+        void runTask(int task_id, int num_total_tasks) {
+            int worker = this->system->workerId();
+            if (worker < this->system->numWorkers() - 1) {
+                this->reduction->runTask(task_id, num_total_tasks, worker);
+                return;
+            }
+            std::lock_guard<std::mutex> lock(this->outside_mutex);
+            this->reduction->runTask(task_id, num_total_tasks, worker);
+        }
+    private:
+        ITaskSystem *system;
+        IReduction *reduction;
+        std::mutex outside_mutex;
+};
+
+/*
+ * One round of a tree combine: task i folds partial i * 2 * stride + stride
+ * into partial i * 2 * stride
+ */
+class CombineRound: public IRunnable {
+    public:
+        CombineRound(IReduction *reduction, int num_partials, int stride)
+            : reduction(reduction), num_partials(num_partials), stride(stride) {}
+        void runTask(int task_id, int num_total_tasks) {
+            int into = task_id * 2 * this->stride;
+            if (into + this->stride < this->num_partials) {
+                this->reduction->combinePartials(into, into + this->stride);
+            }
+        }
+    private:
+        IReduction *reduction;
+        int num_partials;
+        int stride;
+};
+
+void ITaskSystem::runReduce(IReduction* reduction, int num_total_tasks) {
+    reduction->preparePartials(this->num_workers);
+    ReduceTasks tasks(this, reduction);
+    this->run(&tasks, num_total_tasks);
+
+    if (!reduction->parallelCombine()) {
+        for (int i = 1; i < this->num_workers; i++) reduction->combinePartials(0, i);
+        return;
+    }
+    for (int stride = 1; stride < this->num_workers; stride *= 2) {
+        CombineRound round(reduction, this->num_workers, stride);
+        int num_pairs = (this->num_workers + 2 * stride - 1) / (2 * stride);
+        this->run(&round, num_pairs);
+    }
+}
+
+/*
+ * Runs the tiles of a grid launch, task i being the i-th tile in the
+ * launch's tile order
+ */
+class GridTasks: public IRunnable {
+    public:
+        GridTasks(IGridRunnable *runnable, const int size[3], const int tile_size[3],
+                  const int num_tiles[3], const std::vector<int> &tiles)
+            : runnable(runnable), size(size), tile_size(tile_size), num_tiles(num_tiles), tiles(tiles) {}
+        void runTask(int task_id, int num_total_tasks) {
+            int index = this->tiles[task_id];
+            int coords[3] = {
+                index % this->num_tiles[0],
+                (index / this->num_tiles[0]) % this->num_tiles[1],
+                index / (this->num_tiles[0] * this->num_tiles[1]),
+            };
+            Tile tile;
+            for (int d = 0; d < 3; d++) {
+                tile.begin[d] = coords[d] * this->tile_size[d];
+                tile.end[d] = std::min(tile.begin[d] + this->tile_size[d], this->size[d]);
+            }
+            this->runnable->runTile(tile);
+        }
+    private:
+        IGridRunnable *runnable;
+        const int *size;
+        const int *tile_size;
+        const int *num_tiles;
+        const std::vector<int> &tiles;
+};
+
+void ITaskSystem::runGrid(IGridRunnable* runnable, const int size[3], const int tile_size[3],
+                          TileOrder order) {
+    int sizes[3], tile_sizes[3], num_tiles[3];
+    int dims = 1;
+    for (int d = 0; d < 3; d++) {
+        sizes[d] = std::max(0, size[d]);
+        tile_sizes[d] = std::max(1, std::min(tile_size[d], sizes[d]));
+        num_tiles[d] = (sizes[d] + tile_sizes[d] - 1) / tile_sizes[d];
+        if (num_tiles[d] > 1) dims = d + 1;
+    }
+    if (num_tiles[0] * num_tiles[1] * num_tiles[2] == 0) return;
+
+    std::vector<int> tiles = tileOrder(num_tiles, dims, order);
+    GridTasks tasks(runnable, sizes, tile_sizes, num_tiles, tiles);
+    this->run(&tasks, (int)tiles.size());
+}
 
 
 /*
@@ -26,6 +303,7 @@ TaskSystemSerial::~TaskSystemSerial() {}
 
 void TaskSystemSerial::run(IRunnable* runnable, int num_total_tasks) {
     for (int i = 0; i < num_total_tasks; i++) {
+        TaskFrame frame;
         runnable->runTask(i, num_total_tasks);
     }
 }
@@ -33,6 +311,7 @@ void TaskSystemSerial::run(IRunnable* runnable, int num_total_tasks) {
 TaskID TaskSystemSerial::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                           const std::vector<TaskID>& deps) {
     for (int i = 0; i < num_total_tasks; i++) {
+        TaskFrame frame;
         runnable->runTask(i, num_total_tasks);
     }
 
@@ -63,6 +342,7 @@ TaskSystemParallelSpawn::~TaskSystemParallelSpawn() {}
 void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
     for (int i = 0; i < num_total_tasks; i++) {
+        TaskFrame frame;
         runnable->runTask(i, num_total_tasks);
     }
 }
@@ -71,6 +351,7 @@ TaskID TaskSystemParallelSpawn::runAsyncWithDeps(IRunnable* runnable, int num_to
                                                  const std::vector<TaskID>& deps) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
     for (int i = 0; i < num_total_tasks; i++) {
+        TaskFrame frame;
         runnable->runTask(i, num_total_tasks);
     }
 
@@ -82,6 +363,46 @@ void TaskSystemParallelSpawn::sync() {
     return;
 }
 
+/*
+ * ================================================================
+ * Parallel Spawn Arena Task System Implementation
+ * ================================================================
+ */
+
+const char* TaskSystemParallelSpawnArena::name() {
+    return "Parallel + Spawn Arena";
+}
+
+TaskSystemParallelSpawnArena::TaskSystemParallelSpawnArena(int num_threads): ITaskSystem(num_threads) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawnArena in Part B.
+}
+
+TaskSystemParallelSpawnArena::~TaskSystemParallelSpawnArena() {}
+
+void TaskSystemParallelSpawnArena::run(IRunnable* runnable, int num_total_tasks) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawnArena in Part B.
+    for (int i = 0; i < num_total_tasks; i++) {
+        TaskFrame frame;
+        runnable->runTask(i, num_total_tasks);
+    }
+}
+
+TaskID TaskSystemParallelSpawnArena::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                                      const std::vector<TaskID>& deps) {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawnArena in Part B.
+    for (int i = 0; i < num_total_tasks; i++) {
+        TaskFrame frame;
+        runnable->runTask(i, num_total_tasks);
+    }
+
+    return 0;
+}
+
+void TaskSystemParallelSpawnArena::sync() {
+    // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawnArena in Part B.
+    return;
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Spinning Task System Implementation
@@ -101,6 +422,7 @@ TaskSystemParallelThreadPoolSpinning::~TaskSystemParallelThreadPoolSpinning() {}
 void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable, int num_total_tasks) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelThreadPoolSpinning in Part B.
     for (int i = 0; i < num_total_tasks; i++) {
+        TaskFrame frame;
         runnable->runTask(i, num_total_tasks);
     }
 }
@@ -109,6 +431,7 @@ TaskID TaskSystemParallelThreadPoolSpinning::runAsyncWithDeps(IRunnable* runnabl
                                                               const std::vector<TaskID>& deps) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelThreadPoolSpinning in Part B.
     for (int i = 0; i < num_total_tasks; i++) {
+        TaskFrame frame;
         runnable->runTask(i, num_total_tasks);
     }
 
@@ -120,34 +443,102 @@ void TaskSystemParallelThreadPoolSpinning::sync() {
     return;
 }
 
+/*
+ * ================================================================
+ * Fused Launches Implementation
+ * ================================================================
+ */
+
+FusedRunnable::FusedRunnable()
+{
+    this->reset();
+}
+
+void FusedRunnable::reset()
+{
+    this->runnables.clear();
+    this->num_live = 0;
+    this->deadlines.clear();
+    this->has_deadlines = false;
+}
+
+void FusedRunnable::append(IRunnable *runnable)
+{
+    // a launch fused after a cancelled one is not live either
+    int num_live = (int)this->runnables.size();
+    this->runnables.push_back(runnable);
+    this->num_live.compare_exchange_strong(num_live, num_live + 1);
+}
+
+void FusedRunnable::cancelFrom(int index)
+{
+    int num_live = this->num_live.load();
+    while (index < num_live && !this->num_live.compare_exchange_weak(num_live, index)) {}
+}
+
+void FusedRunnable::setDeadline(int index, double deadline)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->deadlines.push_back(std::make_pair(index, deadline));
+    this->has_deadlines = true;
+}
+
+void FusedRunnable::expire()
+{
+    // cancels the launches whose deadline passed
+    std::lock_guard<std::mutex> lock(this->mutex);
+    double now = CycleTimer::currentSeconds();
+    for (const std::pair<int, double> &deadline : this->deadlines) {
+        if (now > deadline.second) this->cancelFrom(deadline.first);
+    }
+}
+
+bool FusedRunnable::dropped(int index)
+{
+    // whether launch index of the chain was cancelled, false if the
+    // record holds a single launch
+    return !this->runnables.empty() && index >= this->num_live.load();
+}
+
 /*
  * ================================================================
  * Tasks Implementation
  * ================================================================
  */
 
-Task::Task(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID> &deps)
-{   
+Task::Task()
+{
+    this->reset(nullptr, 0);
+}
+
+void Task::reset(IRunnable* runnable, int num_total_tasks)
+{
     this->num_tasks = num_total_tasks;
     this->num_done = 0;
     this->num_left = num_total_tasks;
+    this->num_pending_deps = 0;
     this->task_id = -1;     // detached task
-    this->runnable = runnable;
-    this->mutex = new std::mutex(); 
-    this->completed_mutex = new std::mutex();
-    this->completed = new std::condition_variable();
-    this->deps = deps;
+    this->runnable = runnable;  // owned by the caller of runAsyncWithDeps()
+    this->successors.clear();
+    this->predecessors.clear();
+    this->weight = 1;
+    this->chain = 1;
+    this->priority = 1;
+    this->is_queued = false;
     this->is_completed = false;
-    this->is_popped = false;
-}
-
-Task::~Task()
-{
-    delete this->runnable;
-    delete this->mutex;
-    delete this->completed_mutex;
-    delete this->completed;
-    // printf("[TasksQueue] Tasks destructed\n");
+    this->is_done = false;
+    this->num_pins = 0;
+    this->is_cancelled = false;
+    this->deadline = 0;
+    this->sub_pending.clear();
+    this->num_ready = num_total_tasks;
+    this->is_released = false;
+    this->sub_successors.clear();
+    this->has_sub_successors = false;
+    this->fused.reset();
+    this->group = nullptr;
+    this->continuations.clear();
+    this->has_continuations = false;
 }
 
 // Getter and setter methods
@@ -163,19 +554,80 @@ TaskID Task::get_id()
 }
 
 // Task methods
+bool Task::cancelled() {
+    // an expired deadline cancels the task the first time it is noticed
+    if (this->fused.has_deadlines.load(std::memory_order_relaxed)) this->fused.expire();
+    if (this->is_cancelled.load(std::memory_order_relaxed)) return true;
+    double deadline = this->deadline.load(std::memory_order_relaxed);
+    if (deadline > 0 && CycleTimer::currentSeconds() > deadline) {
+        this->is_cancelled = true;
+        return true;
+    }
+    return false;
+}
+
+bool Task::cancelled_at(int index) {
+    // whether dependents on launch index of the task are cancelled
+    return this->is_cancelled || this->fused.dropped(index);
+}
+
+// the ready order set with TASKSYS_PRIORITY, shared by the sleeping and stealing engines
+static ReadyOrder readyOrder()
+{
+    const char* order = getenv("TASKSYS_PRIORITY");
+    if (order && strcmp(order, "fifo") == 0) return READY_FIFO;
+    if (order && strcmp(order, "work") == 0) return READY_CRITICAL_WORK;
+    return READY_CRITICAL_PATH;
+}
+
+/*
+ * Runs the continuations of a launch, shared by the sleeping and
+ * stealing engines. lock guards the list and is released while they
+ * run; continuations added meanwhile are run as well, so the caller
+ * can mark the launch completed as soon as this returns.
+ */
+static void runContinuations(std::unique_lock<std::mutex> &lock, std::vector<IRunnable*> &continuations)
+{
+    while (!continuations.empty()) {
+        std::vector<IRunnable*> batch;
+        batch.swap(continuations);
+        lock.unlock();
+        for (IRunnable *continuation : batch) continuation->runTask(0, 1);
+        lock.lock();
+    }
+}
+
+bool Task::add_successor(Task *task, int index) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->is_completed) return false;
+    DepEdge<Task> edge = {task, index};
+    this->successors.push_back(edge);
+    return true;
+}
+
+bool Task::add_continuation(IRunnable *continuation) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->is_completed) return false;
+    this->continuations.push_back(continuation);
+    return true;
+}
+
 void Task::complete() {
-    std::lock_guard<std::mutex> lock(*this->completed_mutex);
+    // add_successor() and add_continuation() fail from now on, so
+    // successors stops changing
+    std::unique_lock<std::mutex> lock(this->mutex);
+    runContinuations(lock, this->continuations);
     this->is_completed = true;
-    this->completed->notify_all();
+    this->completed.notify_all();
 }
 
 void Task::wait() {
-    std::unique_lock<std::mutex> lock(*this->completed_mutex);
-    this->completed->wait(lock, [this] { return this->is_completed; });
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->completed.wait(lock, [this] { return this->is_completed; });
 }
 
-void Task::run(int task_id) {
-    this->runnable->runTask(task_id, this->num_tasks);
+void Task::run(int begin, int end) {
+    this->schedule.run(this->runnable, begin, end, this->num_tasks);
 }
 
 /*
@@ -184,11 +636,38 @@ void Task::run(int task_id) {
  * ================================================================
  */
 
-TasksQueue::TasksQueue()
+/*
+ * Sub-task dependency arithmetic, shared by the sleeping and stealing
+ * engines: task i of a launch depends on the tasks
+ * [i * stride + begin, i * stride + end) of a dependency.
+ */
+static int floorDiv(int a, int b)
+{
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+// the inputs of task i among the num_dep_tasks tasks of the dependency
+static void subTaskInputs(const SubTaskDep &map, int i, int num_dep_tasks, int *lo, int *hi)
+{
+    *lo = std::max(0, i * map.stride + map.begin);
+    *hi = std::min(num_dep_tasks, i * map.stride + map.end);
+}
+
+// the tasks [*first, *last] of a launch of num_tasks with inputs among [begin, end)
+static void subTaskConsumers(const SubTaskDep &map, int begin, int end, int num_tasks, int *first, int *last)
 {
+    *first = std::max(0, floorDiv(begin - map.end, map.stride) + 1);
+    *last = std::min(num_tasks - 1, floorDiv(end - 1 - map.begin, map.stride));
+}
+
+TasksQueue::TasksQueue(Tracer *tracer)
+{
+    this->tracer = tracer;
     this->counter = 0;
+    this->num_outstanding = 0;
+    this->num_joining = 0;
     this->done = false;
-    this->tasks = new std::queue<Task*>();
+    this->tasks = new std::vector<Task*>();
     this->mutex = new std::mutex();
     this->has_tasks = new std::condition_variable();
 }
@@ -201,55 +680,293 @@ TasksQueue::~TasksQueue()
     // printf("[TasksQueue] Queue destructed\n");
 }
 
-TaskID TasksQueue::next_id()
+TaskID TasksQueue::next_id(int count)
 {
+    // reserves count consecutive ids and returns the first
     std::lock_guard<std::mutex> lock(*this->mutex);
-    return this->tasks->size();
+    this->num_outstanding += count;
+    TaskID id = this->counter;
+    this->counter += count;
+    return id;
 }
 
-
-Task* TasksQueue::front()
-{   
+TaskID TasksQueue::fuse(Task *task, IRunnable *runnable)
+{
+    // Appends runnable to task if no subtask of task has been claimed
+    // yet and returns an id for it that completes along with task,
+    // otherwise -1
     std::lock_guard<std::mutex> lock(*this->mutex);
-    Task* task = this->tasks->front();
-    return task;
+    if (task->num_left != task->num_tasks || task->has_sub_successors || task->is_cancelled) return -1;
+    if (task->fused.runnables.empty()) {
+        task->fused.append(task->runnable);
+        task->runnable = &task->fused;
+    }
+    task->fused.append(runnable);
+    return this->counter++;
 }
 
-void TasksQueue::remove_front()
+// orders the ready heap: highest priority first, then lowest id
+static bool lowerPriority(const Task *a, const Task *b)
 {
-    std::lock_guard<std::mutex> lock(*this->mutex);
-    Task* task = this->tasks->front();
-    this->tasks->pop();
-    task->is_popped = true;
+    if (a->priority != b->priority) return a->priority < b->priority;
+    return a->task_id > b->task_id;
 }
 
 void TasksQueue::push_back(Task *task)
 {
+    // only tasks whose whole-launch dependencies are all completed are
+    // queued, and only while some of their ready subtasks are unclaimed
     std::lock_guard<std::mutex> lock(*this->mutex);
-    if (task->get_id() == -1) {
-        // floating task
-        int id = this->counter;
-        this->counter++;
-        task->set_id(id);
-    }
     // printf("[push_back] Queue push new task id %d with %d subtasks\n", task->get_id(), task->num_tasks);
-    this->tasks->push(task);
+    task->is_released = true;
+    this->requeue(task);
+}
+
+void TasksQueue::requeue(Task *task)
+{
+    // the caller holds the mutex
+    while (task->num_ready < task->num_tasks && task->sub_pending[task->num_ready] == 0) task->num_ready++;
+    if (!task->is_released || task->is_queued || task->num_left == 0) return;
+    // a cancelled task is queued anyway so that its rest gets dropped
+    if (task->num_ready == task->num_tasks - task->num_left && !task->is_cancelled) return;
+    task->is_queued = true;
+    task->priority = task->chain.load(std::memory_order_relaxed);
+    this->tasks->push_back(task);
+    std::push_heap(this->tasks->begin(), this->tasks->end(), lowerPriority);
     this->has_tasks->notify_all();
 }
 
+bool TasksQueue::add_sub_dep(Task *task, Task *dep, int index, const SubTaskDep &map)
+{
+    // Subtasks of dep claimed before now may be done already, so the
+    // subtasks mapped onto them wait for all of dep; the others wait for
+    // exactly their inputs. Returns false if dep is done already.
+    std::lock_guard<std::mutex> lock(*this->mutex);
+    if (dep->is_done) {
+        if (dep->cancelled_at(index)) task->is_cancelled = true;
+        return false;
+    }
+    if (task->sub_pending.empty()) {
+        task->sub_pending.assign(task->num_tasks, 0);
+        task->num_ready = 0;
+    }
+    int watch_from = dep->num_tasks - dep->num_left;
+    int first, last;
+    subTaskConsumers(map, 0, dep->num_tasks, task->num_tasks, &first, &last);
+    for (int i = first; i <= last; i++) {
+        int lo, hi;
+        subTaskInputs(map, i, dep->num_tasks, &lo, &hi);
+        task->sub_pending[i] += std::max(0, hi - std::max(lo, watch_from));
+        if (lo < std::min(hi, watch_from)) task->sub_pending[i]++;
+    }
+    SubTaskEdge<Task> edge = {task, map, watch_from, index};
+    dep->sub_successors.push_back(edge);
+    dep->has_sub_successors = true;
+    return true;
+}
 
-Task* TasksQueue::pop_front()
+void TasksQueue::sub_tasks_done(Task *dep, int begin, int end)
 {
-    // pop_front not actually removing the task from the queue, since Task has many subtasks
-    std::unique_lock<std::mutex> lock(*this->mutex);
-    this->has_tasks->wait(lock, [this] { 
-        // if (this->tasks->empty() && !this->done) printf("[pop_front] Task queue is empty, waiting...\n");
-        return (!this->tasks->empty() || this->done); 
-    });
-    Task* task = this->tasks->front();
+    // releases the subtasks whose inputs include dep's subtasks [begin, end)
+    std::lock_guard<std::mutex> lock(*this->mutex);
+    for (SubTaskEdge<Task> &edge : dep->sub_successors) {
+        int from = std::max(begin, edge.watch_from);
+        if (from >= end) continue;
+        Task *task = edge.task;
+        if (dep->cancelled_at(edge.index)) task->is_cancelled = true;
+        int first, last;
+        subTaskConsumers(edge.map, from, end, task->num_tasks, &first, &last);
+        for (int i = first; i <= last; i++) {
+            int lo, hi;
+            subTaskInputs(edge.map, i, dep->num_tasks, &lo, &hi);
+            task->sub_pending[i] -= std::max(0, std::min(hi, end) - std::max(lo, from));
+        }
+        this->requeue(task);
+    }
+}
+
+void TasksQueue::raise_priorities(Task *task)
+{
+    // A new task lengthens the chains of its unfinished dependencies:
+    // walk up from it and stop wherever a chain does not grow, at a task
+    // whose subtasks all ran, or PRIORITY_WALK_DEPTH launches up. The
+    // caller holds the launch mutex, which guards the walk, so the queue
+    // is only locked to re-sift the queued tasks whose chain grew.
+    if (task->predecessors.empty()) return;
+    bool raised = false;
+    std::vector<std::pair<Task*, int> > stack(1, std::make_pair(task, 0));
+    while (!stack.empty()) {
+        Task *successor = stack.back().first;
+        int depth = stack.back().second + 1;
+        stack.pop_back();
+        if (depth > PRIORITY_WALK_DEPTH) continue;
+        long successor_chain = successor->chain.load(std::memory_order_relaxed);
+        for (Task *predecessor : successor->predecessors) {
+            long chain = predecessor->weight + successor_chain;
+            if (chain <= predecessor->chain.load(std::memory_order_relaxed)) continue;
+            if (predecessor->num_done.load(std::memory_order_relaxed) == predecessor->num_tasks) continue;
+            predecessor->chain.store(chain, std::memory_order_relaxed);
+            raised = true;
+            stack.push_back(std::make_pair(predecessor, depth));
+        }
+    }
+    if (!raised) return;
+
+    // Priorities only grow, so each raised entry just sifts up. Going
+    // from the front, the entries before it form a heap already.
+    std::lock_guard<std::mutex> lock(*this->mutex);
+    for (int i = 0; i < (int)this->tasks->size(); i++) {
+        Task *queued = (*this->tasks)[i];
+        long chain = queued->chain.load(std::memory_order_relaxed);
+        if (chain <= queued->priority) continue;
+        queued->priority = chain;
+        std::push_heap(this->tasks->begin(), this->tasks->begin() + i + 1, lowerPriority);
+    }
+}
+
+Task* TasksQueue::claim(int *begin, int *end, int index)
+{
+    // claims the next chunk of subtasks of the ready task at index, the
+    // front by default, which leaves the queue once its last ready
+    // subtask is claimed; the caller holds the mutex
+    Task* task = (*this->tasks)[index];
+    *begin = task->num_tasks - task->num_left;
+    // the unclaimed rest of a cancelled task is claimed at once and
+    // dropped; otherwise only subtasks whose inputs are done are claimed
+    int chunk = task->num_left;
+    if (!task->cancelled()) {
+        chunk = std::min(std::min(task->schedule.chunk(task->num_left), chunk), task->num_ready - *begin);
+    }
+    *end = *begin + chunk;
+    task->num_left -= chunk;
+    if ((task->num_left == 0 || *end == task->num_ready) && index == 0) {
+        std::pop_heap(this->tasks->begin(), this->tasks->end(), lowerPriority);
+        this->tasks->pop_back();
+        task->is_queued = false;
+    } else if (task->num_left == 0 || *end == task->num_ready) {
+        (*this->tasks)[index] = this->tasks->back();
+        this->tasks->pop_back();
+        std::make_heap(this->tasks->begin(), this->tasks->end(), lowerPriority);
+        task->is_queued = false;
+    }
     return task;
 }
 
+Task* TasksQueue::pop_front(int *begin, int *end, int thread_id)
+{
+    // returns nullptr on shutdown
+    std::unique_lock<std::mutex> lock(*this->mutex);
+    if (this->tasks->empty() && !this->done) {
+        // printf("[pop_front] Task queue is empty, waiting...\n");
+        this->tracer->record(thread_id, TRACE_PARK, -1);
+        this->has_tasks->wait(lock, [this] { 
+            return (!this->tasks->empty() || this->done); 
+        });
+        this->tracer->record(thread_id, TRACE_UNPARK, -1);
+    }
+    if (this->tasks->empty()) return nullptr;
+    return this->claim(begin, end);
+}
+
+Task* TasksQueue::wait_all(int *begin, int *end, bool help)
+{
+    // blocks until every launched task is completed; a helping caller is
+    // handed subtasks of ready tasks meanwhile, nullptr means all done
+    std::unique_lock<std::mutex> lock(*this->mutex);
+    auto ready = [this, help] {
+        return this->num_outstanding == 0 || (help && !this->tasks->empty());
+    };
+    if (!ready()) {
+        this->tracer->record(-1, TRACE_PARK, -1);
+        this->has_tasks->wait(lock, ready);
+        this->tracer->record(-1, TRACE_UNPARK, -1);
+    }
+    if (this->num_outstanding == 0) return nullptr;
+    return this->claim(begin, end);
+}
+
+Task* TasksQueue::wait_task(Task *task, int *begin, int *end, int thread_id)
+{
+    // blocks until task is done, handing out subtasks meanwhile: of task
+    // itself to threads outside the task system, so that they do not
+    // end up running other requests' work, of any ready task to
+    // workers, which other tasks may need; nullptr means task is done
+    std::unique_lock<std::mutex> lock(*this->mutex);
+    int index = -1;
+    auto ready = [this, task, thread_id, &index] {
+        if (task->is_done) return true;
+        index = -1;
+        if (thread_id >= 0) {
+            if (!this->tasks->empty()) index = 0;
+        } else if (task->is_queued) {
+            for (int i = 0; i < (int)this->tasks->size() && index < 0; i++) {
+                if ((*this->tasks)[i] == task) index = i;
+            }
+        }
+        return index >= 0;
+    };
+    if (!ready()) {
+        this->num_joining++;
+        this->tracer->record(thread_id, TRACE_PARK, -1);
+        this->has_tasks->wait(lock, ready);
+        this->tracer->record(thread_id, TRACE_UNPARK, -1);
+        this->num_joining--;
+    }
+    if (task->is_done) return nullptr;
+    return this->claim(begin, end, index);
+}
+
+Task* TasksQueue::wait_group(TaskGroup *group, int *begin, int *end, int thread_id)
+{
+    // blocks until every launch of group is done, handing out subtasks
+    // meanwhile: of the group's ready tasks to threads outside the task
+    // system, of any ready task to workers, which other tasks may need;
+    // nullptr means the group is done
+    std::unique_lock<std::mutex> lock(*this->mutex);
+    int index = -1;
+    auto ready = [this, group, thread_id, &index] {
+        if (group->num_outstanding.load() == 0) return true;
+        index = -1;
+        for (int i = 0; i < (int)this->tasks->size() && index < 0; i++) {
+            if (thread_id >= 0 || (*this->tasks)[i]->group == group) index = i;
+        }
+        return index >= 0;
+    };
+    if (!ready()) {
+        this->num_joining++;
+        this->tracer->record(thread_id, TRACE_PARK, -1);
+        this->has_tasks->wait(lock, ready);
+        this->tracer->record(thread_id, TRACE_UNPARK, -1);
+        this->num_joining--;
+    }
+    if (group->num_outstanding.load() == 0) return nullptr;
+    return this->claim(begin, end, index);
+}
+
+void TasksQueue::task_done(Task *task)
+{
+    std::lock_guard<std::mutex> lock(*this->mutex);
+    // release the subtasks mapped onto subtasks claimed before their edge
+    for (SubTaskEdge<Task> &edge : task->sub_successors) {
+        Task *successor = edge.task;
+        if (task->cancelled_at(edge.index)) successor->is_cancelled = true;
+        int first, last;
+        subTaskConsumers(edge.map, 0, edge.watch_from, successor->num_tasks, &first, &last);
+        for (int i = first; i <= last; i++) {
+            int lo, hi;
+            subTaskInputs(edge.map, i, task->num_tasks, &lo, &hi);
+            if (lo < std::min(hi, edge.watch_from)) successor->sub_pending[i]--;
+        }
+        this->requeue(successor);
+    }
+    this->num_outstanding--;
+    if (task->group) task->group->num_outstanding--;
+    // last, as the task may be retired from here on
+    task->is_done = true;
+    // sync(), wait_task() and wait_group() wait on has_tasks as well
+    if (this->num_outstanding == 0 || this->num_joining > 0) this->has_tasks->notify_all();
+}
+
 void TasksQueue::set_done()
 {
     std::lock_guard<std::mutex> lock(*this->mutex);
@@ -280,14 +997,21 @@ TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(int n
     this->_debug_counter = 0;
     this->_debug_mutex = new std::mutex();
 
-    this->tasks_queue = new TasksQueue();
+    this->tracer = new Tracer("sleep", num_threads);
+    this->tasks_queue = new TasksQueue(this->tracer);
+    this->launch_mutex = new std::mutex();
+    this->tasks = new std::deque<Task*>();
+    this->task_pool = new RecordPool<Task>();
+    this->first_id = 0;
+    this->sync_helps = envFlag("TASKSYS_SYNC_HELP", true);
+    this->ready_order = readyOrder();
     this->num_threads = num_threads;
     this->threads = new std::thread[num_threads];
-    this->done = false;
 
     // Activate threads
     for (int i = 0; i < this->num_threads; i++) {
         this->threads[i] = std::thread(&TaskSystemParallelThreadPoolSleeping::threadFunc, this);
+        this->placement.pin(this->threads[i], i);
     }
 }
 
@@ -297,137 +1021,1306 @@ TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
     // operations (such as thread pool shutdown construction) here.
     // Implementations are free to add new class member variables
     // (requiring changes to tasksys.h).
-    this->done = true;
     this->tasks_queue->set_done();
 
     for (int i = 0; i < this->num_threads; i++) {
         this->threads[i].join();
     }
 
+    this->tracer->dump();
+    delete this->tasks;
+    delete this->task_pool;
     delete this->_debug_mutex;
     delete this->tasks_queue;
+    delete this->launch_mutex;
+    delete this->tracer;
     delete[] this->threads;
     // printf("[TaskSystemParallelThreadPoolSleeping] Threads destructed all\n");
 
 }
 
+void TaskSystemParallelThreadPoolSleeping::taskReady(Task *task, int thread_id) {
+    this->tracer->record(thread_id, TRACE_READY, task->get_id());
+    if (task->num_tasks == 0) {
+        this->taskComplete(task, thread_id);
+        return;
+    }
+    this->tasks_queue->push_back(task);
+}
 
-int TaskSystemParallelThreadPoolSleeping::taskExec(Task *task, int thread_id) {
-    int total_tasks;
-    int task_id = -1;
-
-    // Check if there are tasks to run
-    task->mutex->lock();
-    total_tasks = task->num_tasks;
-    task_id = total_tasks - task->num_left;
-
-    if (task_id < total_tasks) {
-        task->num_left--;
-        task->mutex->unlock();
-
-        task->run(task_id);
-        // Sleep
-        // std::this_thread::sleep_for(std::chrono::milliseconds(50));
-        // printf("[taskExec] Thread %d :: task %d with subtask %d is completed\n", thread_id, task->get_id(), task_id);
-        task->mutex->lock();
-        task->num_done++;
-
-        if (task->num_done == total_tasks) {
-            task->mutex->unlock();
-            task->complete();
-            // printf("[taskExec] Thread %d :: task %d before dequeue, queue size %d\n", thread_id, task->get_id(), this->tasks_queue->tasks->size());
-            this->tasks_queue->remove_front();
-            // printf("[taskExec] Thread %d :: task %d is all completed, queue size %lu\n", thread_id, task->get_id(), this->tasks_queue->tasks->size());
+void TaskSystemParallelThreadPoolSleeping::taskComplete(Task *task, int thread_id) {
+    // release the successors, each edge is visited exactly once; those of
+    // a cancelled launch are cancelled before they can become ready
+    task->complete();
+    for (DepEdge<Task> &edge : task->successors) {
+        Task *successor = edge.task;
+        if (task->cancelled_at(edge.index)) successor->is_cancelled = true;
+        if (successor->num_pending_deps.fetch_sub(1) == 1) {
+            this->taskReady(successor, thread_id);
         }
-        else {
-            task->mutex->unlock();
-        }
-    } 
-    else {
-        task->mutex->unlock();
     }
+    // printf("[taskComplete] task %d is all completed\n", task->get_id());
+    this->tasks_queue->task_done(task);
+}
 
-    return task_id;
+void TaskSystemParallelThreadPoolSleeping::taskExec(Task *task, int begin, int end, int thread_id) {
+    TaskFrame frame;
+    if (task->cancelled()) {
+        this->tracer->record(thread_id, TRACE_CANCEL, task->get_id(), begin, end);
+    } else {
+        this->tracer->record(thread_id, TRACE_RUN_BEGIN, task->get_id(), begin, end);
+        task->run(begin, end);
+        this->tracer->record(thread_id, TRACE_RUN_END, task->get_id(), begin, end);
+    }
+    if (task->has_sub_successors) this->tasks_queue->sub_tasks_done(task, begin, end);
+    // printf("[taskExec] Thread %d :: task %d with subtasks [%d, %d) is completed\n", thread_id, task->get_id(), begin, end);
+    // the task may be retired once its last subtasks are counted
+    int num_tasks = task->num_tasks;
+    if (task->num_done.fetch_add(end - begin) + (end - begin) == num_tasks) {
+        this->taskComplete(task, thread_id);
+    }
 }
 
 
 void TaskSystemParallelThreadPoolSleeping::threadFunc() {
-    // TODO: implement this in the way that each task get a queue from TasksQueue if any, 
-    // go to sleep if no task is available, and wake up when there is a task available
+    // Each thread claims subtasks of ready tasks from TasksQueue, goes to
+    // sleep if no task is available, and wakes up when a task becomes ready
     this->_debug_mutex->lock();
     int _id = this->_debug_counter;
     this->_debug_counter++;
     this->_debug_mutex->unlock();
+    setCurrentWorker(this, _id);
     Task* task;
-    while (!this->done)
+    int begin, end;
+    while (true)
     {   
-        bool can_run = true;
-
-        // printf("[threadFunc] Thread %d spinning\n", _id);
-        task = this->tasks_queue->pop_front();
-        if (this->done) break;
-        if (!task) continue;
+        // printf("[threadFunc] Thread %d waiting\n", _id);
+        task = this->tasks_queue->pop_front(&begin, &end, _id);
+        if (!task) break;
+        this->tracer->record(_id, TRACE_CLAIM, task->get_id(), begin, end);
         // printf("[threadFunc] Thread %d :: queue pop task %d\n", _id, task->get_id());
-        
-        for (auto dep : task->deps)
-        {
-            Task* dep_task = this->tasks_queue->front();
-            if (dep_task && dep_task->get_id() == dep)
-            {   
-                // printf("[threadFunc] Thread %d :: dep %d is completed\n", _id, dep);
-                if (!dep_task->is_completed)
-                {
-                    // printf("[threadFunc] Thread %d :: dep %d is not completed\n", _id, dep);
-                    can_run = false;
-                    break;
-                }
-            }
-        }
-
-        if (can_run) {
-            this->taskExec(task, _id);
-        }
-        else {
-            // printf("[threadFunc] Thread %d :: task %d cannot run, push back to queue\n", _id, task->get_id());
-            this->tasks_queue->mutex->lock();
-            bool is_task_popped = task->is_popped;
-            if (!is_task_popped) this->tasks_queue->push_back(task);
-            this->tasks_queue->mutex->unlock();
-        }
+        this->taskExec(task, begin, end, _id);
     }
 }
 
 void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable, int num_total_tasks) {
-    //
-    // TODO: CS149 students will modify the implementation of this
-    // method in Parts A and B.  The implementation provided below runs all
-    // tasks sequentially on the calling thread.
-    //
-    for (int i = 0; i < num_total_tasks; i++) {
-        runnable->runTask(i, num_total_tasks);
-    }
+    std::vector<TaskID> no_deps;
+    this->runAsyncWithDeps(runnable, num_total_tasks, no_deps);
+    this->sync();
 }
 
 TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                                     const std::vector<TaskID>& deps) {
+    return this->runAsyncWithSubTaskDeps(runnable, num_total_tasks, deps, std::vector<SubTaskDep>());
+}
 
-    //
-    // TODO: CS149 students will implement this method in Part B.
-    //
-    auto task = new Task(runnable, num_total_tasks, deps);
-    this->tasks_queue->push_back(task);
-    return task->get_id();
+TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithSubTaskDeps(IRunnable* runnable, int num_total_tasks,
+                                                                   const std::vector<TaskID>& deps,
+                                                                   const std::vector<SubTaskDep>& sub_task_deps) {
+    return this->launchAsync(runnable, num_total_tasks, deps, sub_task_deps, nullptr);
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::runAsyncInGroup(TaskGroup* group, IRunnable* runnable,
+                                                           int num_total_tasks,
+                                                           const std::vector<TaskID>& deps) {
+    return this->launchAsync(runnable, num_total_tasks, deps, std::vector<SubTaskDep>(), group);
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::launchAsync(IRunnable* runnable, int num_total_tasks,
+                                                       const std::vector<TaskID>& deps,
+                                                       const std::vector<SubTaskDep>& sub_task_deps,
+                                                       TaskGroup *group) {
+    // running tasks may launch tasks too, so registration is serialized
+    int thread_id = currentWorker(this);
+    std::unique_lock<std::mutex> lock(*this->launch_mutex);
+    this->retireTasks();
+
+    // A fusable launch that only depends on the latest launch, which has
+    // as many tasks, no other successors and nothing claimed yet, is
+    // appended to it instead. The fused id shares its task record.
+    TaskID latest = this->first_id + (int)this->tasks->size() - 1;
+    if (deps.size() == 1 && sub_task_deps.empty() && deps[0] == latest && latest >= this->first_id &&
+        num_total_tasks > 0 && runnable->fusable()) {
+        Task *latest_task = this->tasks->back();
+        if (latest_task->num_tasks == num_total_tasks && latest_task->successors.empty() &&
+            latest_task->group == group && !latest_task->has_continuations) {
+            TaskID id = this->tasks_queue->fuse(latest_task, runnable);
+            if (id >= 0) {
+                this->tasks->push_back(latest_task);
+                return id;
+            }
+        }
+    }
+
+    Task *task = this->task_pool->acquire(runnable, num_total_tasks);
+    // the caller of sync() helps the workers
+    task->schedule.configure(this->grain_policy, this->grain_size, this->num_threads + 1);
+    task->set_id(this->tasks_queue->next_id());
+    this->tracer->record(thread_id, TRACE_LAUNCH, task->get_id(), 0, num_total_tasks);
+    this->tasks->push_back(task);
+    // counted before it can complete, task_done() uncounts it
+    task->group = group;
+    if (group) group->num_outstanding++;
+    if (this->ready_order == READY_FIFO) task->weight = 0;
+    if (this->ready_order == READY_CRITICAL_WORK) task->weight = std::max(1, num_total_tasks);
+    task->chain = task->weight;
+    task->priority = task->weight;
+
+    // Register with every unfinished dependency. The extra pending count
+    // keeps the task from becoming ready before all deps are registered.
+    task->num_pending_deps = 1;
+    auto add_dep = [this, task](TaskID dep, const SubTaskDep *map) {
+        if (dep >= task->get_id()) return;
+        // retired tasks are known to be completed
+        if (dep < this->first_id) {
+            if (this->retired_cancelled.contains(dep)) task->is_cancelled = true;
+            return;
+        }
+        Task* dep_task = (*this->tasks)[dep - this->first_id];
+        // index of dep in the chain fused into dep_task
+        int index = dep - dep_task->get_id();
+        if (map) {
+            if (this->tasks_queue->add_sub_dep(task, dep_task, index, *map)) task->predecessors.push_back(dep_task);
+            return;
+        }
+        // count the edge before publishing it, as the dependency may
+        // complete and release it right away
+        task->num_pending_deps++;
+        if (dep_task->add_successor(task, index)) {
+            task->predecessors.push_back(dep_task);
+        } else {
+            task->num_pending_deps--;
+            // a cancelled dependency that already completed passes it on here
+            if (dep_task->cancelled_at(index)) task->is_cancelled = true;
+        }
+    };
+    for (TaskID dep : deps) add_dep(dep, nullptr);
+    for (const SubTaskDep &sub_task_dep : sub_task_deps) {
+        add_dep(sub_task_dep.id, sub_task_dep.stride >= 1 ? &sub_task_dep : nullptr);
+    }
+    if (this->ready_order != READY_FIFO) this->tasks_queue->raise_priorities(task);
+    lock.unlock();
+
+    TaskID id = task->get_id();
+    if (task->num_pending_deps.fetch_sub(1) == 1) this->taskReady(task, thread_id);
+    return id;
+}
+
+TaskID TaskSystemParallelThreadPoolSleeping::replay(const TaskGraph& graph, const std::vector<TaskID>& deps) {
+    // The graph's edges and priorities are precomputed, so its tasks are
+    // wired up directly under one lock. The lock is held until the roots
+    // are ready since another launch may change the tasks deque.
+    int num_nodes = graph.size();
+    if (num_nodes == 0) return -1;
+    int thread_id = currentWorker(this);
+    std::lock_guard<std::mutex> lock(*this->launch_mutex);
+    this->retireTasks();
+    TaskID first = this->tasks_queue->next_id(num_nodes);
+    int base = (int)this->tasks->size();
+    for (int i = 0; i < num_nodes; i++) {
+        const TaskGraph::Node &node = graph.node(i);
+        Task *task = this->task_pool->acquire(node.runnable, node.num_total_tasks);
+        task->schedule.configure(this->grain_policy, this->grain_size, this->num_threads + 1);
+        task->set_id(first + i);
+        this->tracer->record(thread_id, TRACE_LAUNCH, task->get_id(), 0, node.num_total_tasks);
+        if (this->ready_order == READY_FIFO) {
+            task->weight = 0;
+            task->chain = 0;
+        } else if (this->ready_order == READY_CRITICAL_WORK) {
+            task->weight = std::max(1, node.num_total_tasks);
+            task->chain = node.critical_work;
+        } else {
+            task->chain = node.critical_path;
+        }
+        task->priority = task->chain;
+        task->num_pending_deps = node.num_deps + 1;
+        this->tasks->push_back(task);
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        Task *task = (*this->tasks)[base + i];
+        const int *successors = graph.successors(i);
+        for (int j = 0; j < graph.numSuccessors(i); j++) {
+            Task *successor = (*this->tasks)[base + successors[j]];
+            DepEdge<Task> edge = {successor, 0};
+            task->successors.push_back(edge);
+            successor->predecessors.push_back(task);
+        }
+    }
+
+    // the roots register with the unfinished tasks of deps like
+    // launchAsync() does, counting each edge before publishing it
+    for (int i = 0; i < num_nodes; i++) {
+        if (graph.numDeps(i) > 0) continue;
+        Task *task = (*this->tasks)[base + i];
+        for (TaskID dep : deps) {
+            if (dep >= first) continue;
+            if (dep < this->first_id) {
+                if (this->retired_cancelled.contains(dep)) task->is_cancelled = true;
+                continue;
+            }
+            Task *dep_task = (*this->tasks)[dep - this->first_id];
+            int index = dep - dep_task->get_id();
+            task->num_pending_deps++;
+            if (dep_task->add_successor(task, index)) {
+                task->predecessors.push_back(dep_task);
+            } else {
+                task->num_pending_deps--;
+                if (dep_task->cancelled_at(index)) task->is_cancelled = true;
+            }
+        }
+        if (this->ready_order != READY_FIFO) this->tasks_queue->raise_priorities(task);
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        Task *task = (*this->tasks)[base + i];
+        if (task->num_pending_deps.fetch_sub(1) == 1) this->taskReady(task, thread_id);
+    }
+    return first;
 }
 
 void TaskSystemParallelThreadPoolSleeping::sync() {
+    // Sleep until the last task completes, running ready subtasks on the
+    // calling thread in the meantime unless TASKSYS_SYNC_HELP=0
+    Task* task;
+    int begin, end;
+    while ((task = this->tasks_queue->wait_all(&begin, &end, this->sync_helps)) != nullptr) {
+        this->tracer->record(-1, TRACE_CLAIM, task->get_id(), begin, end);
+        this->taskExec(task, begin, end, -1);
+    }
 
-    //
-    // TODO: CS149 students will modify the implementation of this method in Part B.
-    //
+    // tasks other threads launched meanwhile or still wait() on stay
+    std::lock_guard<std::mutex> lock(*this->launch_mutex);
+    this->retireTasks();
+}
+
+void TaskSystemParallelThreadPoolSleeping::retireTasks() {
+    // Recycles the completed tasks at the front, oldest first, so every
+    // task left only has predecessors that are left too. The caller
+    // holds the launch mutex.
+    while (!this->tasks->empty()) {
+        Task *task = this->tasks->front();
+        if (!task->is_done || task->num_pins.load() > 0) return;
+        for (DepEdge<Task> &edge : task->successors) edge.task->predecessors.remove(task);
+        for (SubTaskEdge<Task> &edge : task->sub_successors) edge.task->predecessors.remove(task);
+        // fused launches share the record of the launch they joined,
+        // which always directly precedes them
+        while (!this->tasks->empty() && this->tasks->front() == task) {
+            if (task->cancelled_at(this->first_id - task->get_id())) this->retired_cancelled.insert(this->first_id);
+            this->tasks->pop_front();
+            this->first_id++;
+        }
+        this->task_pool->release(task);
+    }
+}
+
+Task* TaskSystemParallelThreadPoolSleeping::findTask(TaskID task_id) {
+    // nullptr for retired tasks, which are completed; the caller holds
+    // the launch mutex
+    if (task_id < this->first_id || task_id - this->first_id >= (int)this->tasks->size()) return nullptr;
+    return (*this->tasks)[task_id - this->first_id];
+}
+
+void TaskSystemParallelThreadPoolSleeping::wait(TaskID task_id) {
+    // Like sync() but for one task, and always helping: a worker waiting
+    // from inside runTask() keeps running ready subtasks until it is done
+    std::unique_lock<std::mutex> lock(*this->launch_mutex);
+    Task *waited = this->findTask(task_id);
+    if (!waited) return;
+    // pinned so that it is not retired before this thread sees it done
+    waited->num_pins++;
+    lock.unlock();
+    int thread_id = currentWorker(this);
+    Task* task;
+    int begin, end;
+    while ((task = this->tasks_queue->wait_task(waited, &begin, &end, thread_id)) != nullptr) {
+        this->tracer->record(thread_id, TRACE_CLAIM, task->get_id(), begin, end);
+        this->taskExec(task, begin, end, thread_id);
+    }
+    waited->num_pins--;
+}
+
+void TaskSystemParallelThreadPoolSleeping::waitGroup(TaskGroup* group) {
+    // like wait(), but a thread outside the task system only helps the group
+    int thread_id = currentWorker(this);
+    Task* task;
+    int begin, end;
+    while ((task = this->tasks_queue->wait_group(group, &begin, &end, thread_id)) != nullptr) {
+        this->tracer->record(thread_id, TRACE_CLAIM, task->get_id(), begin, end);
+        this->taskExec(task, begin, end, thread_id);
+    }
+}
+
+void TaskSystemParallelThreadPoolSleeping::cancel(TaskID task_id) {
+    // the task's remaining subtasks are dropped when next claimed; a
+    // completed task is left alone so that later dependents still run.
+    // A launch fused into the task only drops its part of the chain.
+    std::lock_guard<std::mutex> launch_lock(*this->launch_mutex);
+    Task *task = this->findTask(task_id);
+    if (!task) return;
+    std::lock_guard<std::mutex> lock(task->mutex);
+    if (task->is_completed) return;
+    int index = task_id - task->get_id();
+    if (index > 0) task->fused.cancelFrom(index);
+    else task->is_cancelled = true;
+}
+
+void TaskSystemParallelThreadPoolSleeping::setDeadline(TaskID task_id, double seconds) {
+    std::lock_guard<std::mutex> launch_lock(*this->launch_mutex);
+    Task *task = this->findTask(task_id);
+    if (!task) return;
+    std::lock_guard<std::mutex> lock(task->mutex);
+    if (task->is_completed) return;
+    double deadline = CycleTimer::currentSeconds() + seconds;
+    int index = task_id - task->get_id();
+    if (index > 0) task->fused.setDeadline(index, deadline);
+    else task->deadline = deadline;
+}
+
+void TaskSystemParallelThreadPoolSleeping::addContinuation(TaskID task_id, IRunnable* continuation) {
+    // complete() runs it unless the task completed already; the launch
+    // lock keeps later launches from fusing into the task meanwhile
+    std::unique_lock<std::mutex> lock(*this->launch_mutex);
+    Task *task = this->findTask(task_id);
+    if (task) task->has_continuations = true;
+    bool added = task && task->add_continuation(continuation);
+    lock.unlock();
+    if (!added) continuation->runTask(0, 1);
+}
+
+
+/*
+ * ================================================================
+ * Work-Stealing Deque Implementation
+ * ================================================================
+ */
+
+StealLaunch::StealLaunch()
+{
+    this->reset(nullptr, 0);
+}
+
+void StealLaunch::reset(IRunnable* runnable, int num_total_tasks)
+{
+    this->runnable = runnable;
+    this->num_total_tasks = num_total_tasks;
+    this->id = -1;
+    this->num_done = 0;
+    this->num_pending_deps = 0;
+    this->is_cancelled = false;
+    this->deadline = 0;
+    this->is_completed = false;
+    this->num_pins = 0;
+    this->successors.clear();
+    this->sub_pending.clear();
+    this->is_started = false;
+    this->sub_successors.clear();
+    this->has_sub_successors = false;
+    this->fused.reset();
+    this->group = nullptr;
+    this->continuations.clear();
+    this->predecessors.clear();
+    this->weight = 1;
+    this->chain = 1;
+    this->priority = 1;
+}
+
+bool StealLaunch::cancelled() {
+    // an expired deadline cancels the launch the first time it is noticed
+    if (this->fused.has_deadlines.load(std::memory_order_relaxed)) this->fused.expire();
+    if (this->is_cancelled.load(std::memory_order_relaxed)) return true;
+    double deadline = this->deadline.load(std::memory_order_relaxed);
+    if (deadline > 0 && CycleTimer::currentSeconds() > deadline) {
+        this->is_cancelled = true;
+        return true;
+    }
+    return false;
+}
+
+bool StealLaunch::cancelledAt(int index) {
+    // whether dependents on launch index of the record are cancelled
+    return this->is_cancelled || this->fused.dropped(index);
+}
+
+WorkStealingDeque::WorkStealingDeque(int capacity)
+{
+    long size = 1;
+    while (size < capacity) size <<= 1;
+    this->mask = size - 1;
+    this->slots = new Slot[size];
+    this->top = 0;
+    this->bottom = 0;
+}
+
+WorkStealingDeque::~WorkStealingDeque()
+{
+    delete[] this->slots;
+}
+
+void WorkStealingDeque::load(long index, StealRange *range)
+{
+    Slot &slot = this->slots[index & this->mask];
+    range->launch = slot.launch.load(std::memory_order_relaxed);
+    range->begin = slot.begin.load(std::memory_order_relaxed);
+    range->end = slot.end.load(std::memory_order_relaxed);
+}
+
+bool WorkStealingDeque::push(const StealRange &range)
+{
+    long b = this->bottom.load(std::memory_order_relaxed);
+    long t = this->top.load(std::memory_order_acquire);
+    if (b - t > this->mask) return false;
+
+    Slot &slot = this->slots[b & this->mask];
+    slot.launch.store(range.launch, std::memory_order_relaxed);
+    slot.begin.store(range.begin, std::memory_order_relaxed);
+    slot.end.store(range.end, std::memory_order_relaxed);
+    // publishes the slot to thieves, whose load of bottom acquires it
+    this->bottom.store(b + 1, std::memory_order_release);
+    return true;
+}
+
+bool WorkStealingDeque::pop(StealRange *range)
+{
+    long b = this->bottom.load(std::memory_order_relaxed) - 1;
+    this->bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long t = this->top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        // empty
+        this->bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+    this->load(b, range);
+    if (t == b) {
+        // last element: race against thieves for it
+        bool won = this->top.compare_exchange_strong(t, t + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed);
+        this->bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+bool WorkStealingDeque::steal(StealRange *range)
+{
+    long t = this->top.load(std::memory_order_acquire);
     while (true) {
-        std::lock_guard<std::mutex> lock(*this->tasks_queue->mutex);
-        if (this->tasks_queue->tasks->empty()) break;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long b = this->bottom.load(std::memory_order_acquire);
+        if (t >= b) return false;
+
+        this->load(t, range);
+        if (this->top.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return true;
+        }
+        // lost the race to another thief or the owner, t was reloaded
     }
-    printf("[sync] All tasks are completed\n");
-    return;
+}
+
+/*
+ * ================================================================
+ * Parallel Thread Pool Work-Stealing Task System Implementation
+ * ================================================================
+ */
+
+// capacity of each worker's deque; splitting only nests log2(num_total_tasks) deep
+#define STEAL_DEQUE_CAPACITY 1024
+// rounds of failed stealing before an idle worker goes to sleep
+#define STEAL_ROUNDS_BEFORE_SLEEP 16
+
+// orders the injected heap: highest priority first, then lowest launch
+// id; ranges of one launch may come out in any order
+static bool lowerStealPriority(const StealRange &a, const StealRange &b)
+{
+    if (a.launch->priority != b.launch->priority) return a.launch->priority < b.launch->priority;
+    return a.launch->id > b.launch->id;
+}
+
+static inline unsigned int xorshift(unsigned int *seed) {
+    unsigned int x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+const char* TaskSystemParallelThreadPoolStealing::name() {
+    return "Parallel + Thread Pool + Steal";
+}
+
+TaskSystemParallelThreadPoolStealing::TaskSystemParallelThreadPoolStealing(int num_threads): ITaskSystem(num_threads) {
+    this->num_threads = num_threads;
+    this->first_id = 0;
+    this->next_id = 0;
+    this->launch_pool = new RecordPool<StealLaunch>();
+    this->launch_mutex = new std::mutex();
+    this->num_joining = 0;
+    this->num_outstanding = 0;
+    this->completed_mutex = new std::mutex();
+    this->completed = new std::condition_variable();
+    this->injected = new std::vector<StealRange>();
+    this->num_injected = 0;
+    this->injected_mutex = new std::mutex();
+    this->num_sleeping = 0;
+    this->wake_epoch = 0;
+    this->wake_mutex = new std::mutex();
+    this->wake = new std::condition_variable();
+    this->done = false;
+
+    this->sync_helps = envFlag("TASKSYS_SYNC_HELP", true);
+    this->ready_order = readyOrder();
+    this->num_deques = num_threads + 1;
+    this->outside_deque_claimed = false;
+    this->tracer = new Tracer("steal", this->num_deques);
+    this->deques = new WorkStealingDeque*[this->num_deques];
+    for (int i = 0; i < this->num_deques; i++) {
+        this->deques[i] = new WorkStealingDeque(STEAL_DEQUE_CAPACITY);
+    }
+    this->threads = new std::thread[num_threads];
+    for (int i = 0; i < this->num_threads; i++) {
+        this->threads[i] = std::thread(&TaskSystemParallelThreadPoolStealing::threadFunc, this, i);
+        this->placement.pin(this->threads[i], i);
+    }
+}
+
+TaskSystemParallelThreadPoolStealing::~TaskSystemParallelThreadPoolStealing() {
+    {
+        std::lock_guard<std::mutex> lock(*this->wake_mutex);
+        this->done = true;
+        this->wake_epoch++;
+    }
+    this->wake->notify_all();
+    for (int i = 0; i < this->num_threads; i++) {
+        this->threads[i].join();
+    }
+
+    this->tracer->dump();
+    delete this->launch_pool;
+    for (int i = 0; i < this->num_deques; i++) delete this->deques[i];
+    delete[] this->deques;
+    delete[] this->threads;
+    delete this->launch_mutex;
+    delete this->completed_mutex;
+    delete this->completed;
+    delete this->injected;
+    delete this->injected_mutex;
+    delete this->wake_mutex;
+    delete this->wake;
+    delete this->tracer;
+}
+
+void TaskSystemParallelThreadPoolStealing::notifySleepers(bool all) {
+    // pairs with the increment of num_sleeping before a worker's final look for work
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (this->num_sleeping.load(std::memory_order_relaxed) == 0) return;
+
+    {
+        std::lock_guard<std::mutex> lock(*this->wake_mutex);
+        this->wake_epoch++;
+    }
+    // a thread in waitGroup() may not take the work it would be woken for
+    if (all || this->num_joining.load() > 0) this->wake->notify_all();
+    else this->wake->notify_one();
+}
+
+void TaskSystemParallelThreadPoolStealing::inject(StealLaunch *launch, int thread_id) {
+    this->tracer->record(thread_id, TRACE_READY, launch->id);
+    std::unique_lock<std::mutex> lock(launch->mutex);
+    launch->is_started = true;
+    if (launch->num_total_tasks == 0) {
+        lock.unlock();
+        this->complete(launch, thread_id);
+        return;
+    }
+
+    if (launch->sub_pending.empty()) {
+        lock.unlock();
+        StealRange range = {launch, 0, launch->num_total_tasks};
+        this->injectRange(range);
+        this->notifySleepers(range.end > 1);
+        return;
+    }
+
+    // only the runs of tasks whose inputs are done, subTasksDone() injects the rest
+    int run_begin = -1;
+    for (int i = 0; i <= launch->num_total_tasks; i++) {
+        bool ready = i < launch->num_total_tasks && launch->sub_pending[i] == 0;
+        if (ready && run_begin < 0) run_begin = i;
+        if (!ready && run_begin >= 0) {
+            StealRange range = {launch, run_begin, i};
+            this->injectRange(range);
+            run_begin = -1;
+        }
+    }
+    lock.unlock();
+    this->notifySleepers(true);
+}
+
+void TaskSystemParallelThreadPoolStealing::raisePriorities(StealLaunch *launch) {
+    // Like TasksQueue::raise_priorities(): walks up from a new launch
+    // while chains grow, skipping retired and finished dependencies, then
+    // re-sifts the injected ranges whose launch's chain grew. The caller
+    // holds the launch mutex, which guards the walk.
+    if (launch->predecessors.empty()) return;
+    bool raised = false;
+    std::vector<std::pair<StealLaunch*, int> > stack(1, std::make_pair(launch, 0));
+    while (!stack.empty()) {
+        StealLaunch *successor = stack.back().first;
+        int depth = stack.back().second + 1;
+        stack.pop_back();
+        if (depth > PRIORITY_WALK_DEPTH) continue;
+        long successor_chain = successor->chain.load(std::memory_order_relaxed);
+        for (TaskID dep : successor->predecessors) {
+            if (dep < this->first_id) continue;
+            StealLaunch *predecessor = this->launches[dep - this->first_id];
+            long chain = predecessor->weight + successor_chain;
+            if (chain <= predecessor->chain.load(std::memory_order_relaxed)) continue;
+            if (predecessor->num_done.load(std::memory_order_relaxed) == predecessor->num_total_tasks) continue;
+            predecessor->chain.store(chain, std::memory_order_relaxed);
+            raised = true;
+            stack.push_back(std::make_pair(predecessor, depth));
+        }
+    }
+    if (!raised) return;
+
+    // a launch may have several ranges queued, so the heap is rebuilt
+    // rather than each raised range sifted up
+    std::lock_guard<std::mutex> lock(*this->injected_mutex);
+    bool changed = false;
+    for (StealRange &queued : *this->injected) {
+        long chain = queued.launch->chain.load(std::memory_order_relaxed);
+        if (chain <= queued.launch->priority) continue;
+        queued.launch->priority = chain;
+        changed = true;
+    }
+    if (changed) std::make_heap(this->injected->begin(), this->injected->end(), lowerStealPriority);
+}
+
+void TaskSystemParallelThreadPoolStealing::injectRange(StealRange range) {
+    std::lock_guard<std::mutex> lock(*this->injected_mutex);
+    // a launch's chain may have grown since its ranges were last queued
+    StealLaunch *launch = range.launch;
+    long chain = launch->chain.load(std::memory_order_relaxed);
+    if (chain > launch->priority) {
+        launch->priority = chain;
+        std::make_heap(this->injected->begin(), this->injected->end(), lowerStealPriority);
+    }
+    this->injected->push_back(range);
+    std::push_heap(this->injected->begin(), this->injected->end(), lowerStealPriority);
+    this->num_injected++;
+}
+
+void TaskSystemParallelThreadPoolStealing::subTasksDone(StealLaunch *launch, int begin, int end) {
+    // Injects the tasks whose last inputs were the launch's tasks [begin,
+    // end), in runs, once their own launch is injected. sub_successors
+    // no longer changes once the launch is injected, so only the
+    // successors are locked.
+    bool injected = false;
+    for (SubTaskEdge<StealLaunch> &edge : launch->sub_successors) {
+        StealLaunch *successor = edge.task;
+        std::lock_guard<std::mutex> successor_lock(successor->mutex);
+        if (launch->cancelledAt(edge.index)) successor->is_cancelled = true;
+        int first, last;
+        subTaskConsumers(edge.map, begin, end, successor->num_total_tasks, &first, &last);
+        int run_begin = -1;
+        for (int i = first; i <= last + 1; i++) {
+            bool ready = false;
+            if (i <= last) {
+                int lo, hi;
+                subTaskInputs(edge.map, i, launch->num_total_tasks, &lo, &hi);
+                int count = std::max(0, std::min(hi, end) - std::max(lo, begin));
+                successor->sub_pending[i] -= count;
+                ready = successor->is_started && count > 0 && successor->sub_pending[i] == 0;
+            }
+            if (ready && run_begin < 0) run_begin = i;
+            if (!ready && run_begin >= 0) {
+                StealRange range = {successor, run_begin, i};
+                this->injectRange(range);
+                run_begin = -1;
+                injected = true;
+            }
+        }
+    }
+    if (injected) this->notifySleepers(true);
+}
+
+void TaskSystemParallelThreadPoolStealing::complete(StealLaunch *launch, int thread_id) {
+    // launch may be retired as soon as its mutex is released, so what is
+    // needed of it afterwards is copied out first
+    std::vector<DepEdge<StealLaunch> > successors;
+    TaskGroup *group;
+    {
+        std::unique_lock<std::mutex> lock(launch->mutex);
+        runContinuations(lock, launch->continuations);
+        launch->is_completed = true;
+        successors.swap(launch->successors);
+        group = launch->group;
+        // successors of a cancelled launch are cancelled before they are injected
+        for (DepEdge<StealLaunch> &edge : successors) {
+            if (launch->cancelledAt(edge.index)) edge.task->is_cancelled = true;
+        }
+    }
+    for (DepEdge<StealLaunch> &edge : successors) {
+        StealLaunch *successor = edge.task;
+        if (successor->num_pending_deps.fetch_sub(1) == 1) this->inject(successor, thread_id);
+    }
+
+    // A thread in wait() either saw is_completed or was counted in
+    // num_joining before this launch's mutex was taken above; likewise
+    // for waitGroup() and the group's count
+    if (group) group->num_outstanding--;
+    if (this->num_joining.load() > 0) {
+        {
+            std::lock_guard<std::mutex> lock(*this->wake_mutex);
+            this->wake_epoch++;
+        }
+        this->wake->notify_all();
+    }
+
+    if (this->num_outstanding.fetch_sub(1) == 1) {
+        {
+            std::lock_guard<std::mutex> lock(*this->completed_mutex);
+            this->completed->notify_all();
+        }
+        // a helping sync() may be asleep on wake instead
+        if (this->sync_helps) {
+            std::lock_guard<std::mutex> lock(*this->wake_mutex);
+            this->wake->notify_all();
+        }
+    }
+}
+
+bool TaskSystemParallelThreadPoolStealing::findWork(int thread_id, unsigned int *seed, StealRange *range) {
+    if (thread_id < this->num_deques && this->deques[thread_id]->pop(range)) return true;
+
+    if (this->num_injected.load() > 0) {
+        std::lock_guard<std::mutex> lock(*this->injected_mutex);
+        if (!this->injected->empty()) {
+            std::pop_heap(this->injected->begin(), this->injected->end(), lowerStealPriority);
+            *range = this->injected->back();
+            this->injected->pop_back();
+            this->num_injected--;
+            return true;
+        }
+    }
+
+    // sweep every other deque, starting from a random victim
+    int start = xorshift(seed) % this->num_deques;
+    for (int i = 0; i < this->num_deques; i++) {
+        int victim = (start + i) % this->num_deques;
+        if (victim == thread_id) continue;
+        if (this->deques[victim]->steal(range)) return true;
+    }
+    return false;
+}
+
+int TaskSystemParallelThreadPoolStealing::claimDeque() {
+    // A thread outside the task system works as the owner of
+    // deques[num_threads] if no other such thread does, else as worker
+    // num_deques without a deque, since only one thread may push to and
+    // pop from a deque
+    if (!this->outside_deque_claimed.exchange(true)) return this->num_threads;
+    return this->num_deques;
+}
+
+void TaskSystemParallelThreadPoolStealing::releaseDeque(int thread_id) {
+    // ranges left in the deque stay there for thieves and its next owner
+    if (thread_id == this->num_threads) this->outside_deque_claimed = false;
+}
+
+int TaskSystemParallelThreadPoolStealing::splitGrain(StealLaunch *launch) {
+    // Ranges are not split below this size. Unless a grain policy was
+    // selected, that is an eighth of each thread's share of the launch,
+    // which keeps deque traffic low for launches of many light tasks
+    int num_total_tasks = launch->num_total_tasks;
+    if (!this->grain_policy_set) return std::max(1, num_total_tasks / (8 * this->num_threads));
+    return launch->schedule.chunk(num_total_tasks - launch->num_done.load(std::memory_order_relaxed));
+}
+
+bool TaskSystemParallelThreadPoolStealing::takeWaitedWork(StealLaunch *waited, TaskGroup *group,
+                                                          StealRange *range) {
+    // takes the first chunk of an injected range of the waited launch, or
+    // else of the group, leaving the rest queued for the workers
+    if (this->num_injected.load() == 0) return false;
+    std::lock_guard<std::mutex> lock(*this->injected_mutex);
+    for (auto it = this->injected->begin(); it != this->injected->end(); it++) {
+        StealLaunch *launch = it->launch;
+        if (waited ? launch != waited : launch->group != group) continue;
+        int grain = this->splitGrain(launch);
+        if (it->end - it->begin > grain) {
+            *range = *it;
+            range->end = range->begin + grain;
+            it->begin = range->end;
+        } else {
+            *range = *it;
+            *it = this->injected->back();
+            this->injected->pop_back();
+            std::make_heap(this->injected->begin(), this->injected->end(), lowerStealPriority);
+            this->num_injected--;
+        }
+        return true;
+    }
+    return false;
+}
+
+void TaskSystemParallelThreadPoolStealing::keepGrain(StealRange *range, int grain) {
+    // a thread outside the task system without a deque keeps one grain
+    // and puts the rest back in the injected queue, ahead of later launches
+    StealRange rest = {range->launch, range->begin + grain, range->end};
+    this->injectRange(rest);
+    range->end = rest.begin;
+    this->notifySleepers(false);
+}
+
+void TaskSystemParallelThreadPoolStealing::execute(int thread_id, StealRange range) {
+    TaskFrame frame;
+    StealLaunch *launch = range.launch;
+    int num_total_tasks = launch->num_total_tasks;
+    int grain = this->splitGrain(launch);
+    this->tracer->record(thread_id, TRACE_CLAIM, launch->id, range.begin, range.end);
+
+    // a cancelled launch's range is dropped whole instead of split
+    if (launch->cancelled()) {
+        this->tracer->record(thread_id, TRACE_CANCEL, launch->id, range.begin, range.end);
+        if (launch->has_sub_successors) this->subTasksDone(launch, range.begin, range.end);
+        int count = range.end - range.begin;
+        if (launch->num_done.fetch_add(count) + count == num_total_tasks) {
+            this->complete(launch, thread_id);
+        }
+        return;
+    }
+
+    // keep the lower half, expose the upper half to thieves
+    while (thread_id < this->num_deques && range.end - range.begin > grain) {
+        int mid = range.begin + (range.end - range.begin) / 2;
+        StealRange upper = {launch, mid, range.end};
+        if (!this->deques[thread_id]->push(upper)) break;
+        range.end = mid;
+        this->notifySleepers(false);
+    }
+    if (thread_id >= this->num_deques && range.end - range.begin > grain) this->keepGrain(&range, grain);
+
+    this->tracer->record(thread_id, TRACE_RUN_BEGIN, launch->id, range.begin, range.end);
+    launch->schedule.run(launch->runnable, range.begin, range.end, num_total_tasks);
+    this->tracer->record(thread_id, TRACE_RUN_END, launch->id, range.begin, range.end);
+    if (launch->has_sub_successors) this->subTasksDone(launch, range.begin, range.end);
+
+    int count = range.end - range.begin;
+    if (launch->num_done.fetch_add(count) + count == num_total_tasks) {
+        this->complete(launch, thread_id);
+    }
+}
+
+void TaskSystemParallelThreadPoolStealing::threadFunc(int thread_id) {
+    setCurrentWorker(this, thread_id);
+    unsigned int seed = thread_id + 1;
+    StealRange range;
+    while (true) {
+        bool found = this->findWork(thread_id, &seed, &range);
+        for (int i = 0; !found && i < STEAL_ROUNDS_BEFORE_SLEEP; i++) {
+            std::this_thread::yield();
+            found = this->findWork(thread_id, &seed, &range);
+        }
+        if (found) {
+            this->execute(thread_id, range);
+            continue;
+        }
+
+        // Announce the intent to sleep before the final look for work, so
+        // that a concurrent push either is seen here or bumps wake_epoch.
+        std::unique_lock<std::mutex> lock(*this->wake_mutex);
+        if (this->done) break;
+        long epoch = this->wake_epoch;
+        this->num_sleeping++;
+        lock.unlock();
+
+        if (this->findWork(thread_id, &seed, &range)) {
+            this->num_sleeping--;
+            this->execute(thread_id, range);
+            continue;
+        }
+
+        lock.lock();
+        this->tracer->record(thread_id, TRACE_PARK, -1);
+        while (epoch == this->wake_epoch && !this->done) {
+            this->wake->wait(lock);
+        }
+        this->tracer->record(thread_id, TRACE_UNPARK, -1);
+        this->num_sleeping--;
+    }
+}
+
+void TaskSystemParallelThreadPoolStealing::run(IRunnable* runnable, int num_total_tasks) {
+    std::vector<TaskID> no_deps;
+    this->runAsyncWithDeps(runnable, num_total_tasks, no_deps);
+    this->sync();
+}
+
+TaskID TaskSystemParallelThreadPoolStealing::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                                              const std::vector<TaskID>& deps) {
+    return this->runAsyncWithSubTaskDeps(runnable, num_total_tasks, deps, std::vector<SubTaskDep>());
+}
+
+TaskID TaskSystemParallelThreadPoolStealing::runAsyncWithSubTaskDeps(IRunnable* runnable, int num_total_tasks,
+                                                                     const std::vector<TaskID>& deps,
+                                                                     const std::vector<SubTaskDep>& sub_task_deps) {
+    return this->launchAsync(runnable, num_total_tasks, deps, sub_task_deps, nullptr);
+}
+
+TaskID TaskSystemParallelThreadPoolStealing::runAsyncInGroup(TaskGroup* group, IRunnable* runnable,
+                                                             int num_total_tasks,
+                                                             const std::vector<TaskID>& deps) {
+    return this->launchAsync(runnable, num_total_tasks, deps, std::vector<SubTaskDep>(), group);
+}
+
+TaskID TaskSystemParallelThreadPoolStealing::launchAsync(IRunnable* runnable, int num_total_tasks,
+                                                         const std::vector<TaskID>& deps,
+                                                         const std::vector<SubTaskDep>& sub_task_deps,
+                                                         TaskGroup *group) {
+    // running tasks may launch tasks too, so registration is serialized
+    int thread_id = currentWorker(this);
+    if (thread_id < 0) thread_id = this->num_deques;
+    std::unique_lock<std::mutex> launch_lock(*this->launch_mutex);
+    this->retireLaunches();
+
+    // A fusable launch that only depends on the latest launch, which has
+    // as many tasks, no successors and was not injected yet, is appended
+    // to it instead. The fused id shares its launch record.
+    if (deps.size() == 1 && sub_task_deps.empty() && deps[0] == this->next_id - 1 && deps[0] >= this->first_id &&
+        num_total_tasks > 0 && runnable->fusable()) {
+        StealLaunch *latest = this->launches.back();
+        std::lock_guard<std::mutex> lock(latest->mutex);
+        if (!latest->is_started && !latest->is_cancelled && latest->num_total_tasks == num_total_tasks &&
+            latest->successors.empty() && !latest->has_sub_successors && latest->group == group &&
+            latest->continuations.empty()) {
+            if (latest->fused.runnables.empty()) {
+                latest->fused.append(latest->runnable);
+                latest->runnable = &latest->fused;
+            }
+            latest->fused.append(runnable);
+            this->launches.push_back(latest);
+            return this->next_id++;
+        }
+    }
+
+    StealLaunch *launch = this->launch_pool->acquire(runnable, num_total_tasks);
+    launch->id = this->next_id++;
+    launch->schedule.configure(this->grain_policy, this->grain_size, this->num_threads + this->sync_helps);
+    this->launches.push_back(launch);
+    this->num_outstanding++;
+    // counted before it can complete, complete() uncounts it
+    launch->group = group;
+    if (group) group->num_outstanding++;
+    this->tracer->record(thread_id, TRACE_LAUNCH, launch->id, 0, num_total_tasks);
+    if (this->ready_order == READY_FIFO) launch->weight = 0;
+    if (this->ready_order == READY_CRITICAL_WORK) launch->weight = std::max(1, num_total_tasks);
+    launch->chain = launch->weight;
+    launch->priority = launch->weight;
+
+    // hold one extra count so the launch cannot become ready while deps are registered
+    launch->num_pending_deps = 1;
+    auto add_dep = [this, launch](TaskID dep, const SubTaskDep *map) {
+        if (dep >= launch->id) return;
+        // retired launches are known to be complete
+        if (dep < this->first_id) {
+            if (this->retired_cancelled.contains(dep)) launch->is_cancelled = true;
+            return;
+        }
+        StealLaunch *dep_launch = this->launches[dep - this->first_id];
+        // index of dep in the chain fused into dep_launch
+        int index = dep - dep_launch->id;
+        std::lock_guard<std::mutex> lock(dep_launch->mutex);
+        if (dep_launch->is_completed) {
+            // a cancelled dependency that already completed passes it on here
+            if (dep_launch->cancelledAt(index)) launch->is_cancelled = true;
+        } else if (map && !dep_launch->is_started) {
+            // every task of dep_launch will report to subTasksDone()
+            if (launch->sub_pending.empty()) launch->sub_pending.assign(launch->num_total_tasks, 0);
+            int first, last;
+            subTaskConsumers(*map, 0, dep_launch->num_total_tasks, launch->num_total_tasks, &first, &last);
+            for (int i = first; i <= last; i++) {
+                int lo, hi;
+                subTaskInputs(*map, i, dep_launch->num_total_tasks, &lo, &hi);
+                launch->sub_pending[i] += std::max(0, hi - lo);
+            }
+            SubTaskEdge<StealLaunch> edge = {launch, *map, 0, index};
+            dep_launch->sub_successors.push_back(edge);
+            dep_launch->has_sub_successors = true;
+            launch->predecessors.push_back(dep);
+        } else {
+            DepEdge<StealLaunch> edge = {launch, index};
+            dep_launch->successors.push_back(edge);
+            launch->num_pending_deps++;
+            launch->predecessors.push_back(dep);
+        }
+    };
+    for (TaskID dep : deps) add_dep(dep, nullptr);
+    for (const SubTaskDep &sub_task_dep : sub_task_deps) {
+        add_dep(sub_task_dep.id, sub_task_dep.stride >= 1 ? &sub_task_dep : nullptr);
+    }
+    if (this->ready_order != READY_FIFO) this->raisePriorities(launch);
+    launch_lock.unlock();
+    TaskID id = launch->id;
+    if (launch->num_pending_deps.fetch_sub(1) == 1) this->inject(launch, thread_id);
+
+    return id;
+}
+
+TaskID TaskSystemParallelThreadPoolStealing::replay(const TaskGraph& graph, const std::vector<TaskID>& deps) {
+    // The graph's edges and priorities are precomputed, so its launches
+    // are wired up directly under one lock. The lock is held until the
+    // roots are injected since another launch may change the launches
+    // deque.
+    int num_nodes = graph.size();
+    if (num_nodes == 0) return -1;
+    int thread_id = currentWorker(this);
+    if (thread_id < 0) thread_id = this->num_deques;
+    std::lock_guard<std::mutex> lock(*this->launch_mutex);
+    this->retireLaunches();
+    int base = (int)this->launches.size();
+    for (int i = 0; i < num_nodes; i++) {
+        const TaskGraph::Node &node = graph.node(i);
+        StealLaunch *launch = this->launch_pool->acquire(node.runnable, node.num_total_tasks);
+        launch->id = this->next_id++;
+        launch->schedule.configure(this->grain_policy, this->grain_size, this->num_threads + this->sync_helps);
+        launch->num_pending_deps = node.num_deps + 1;
+        this->tracer->record(thread_id, TRACE_LAUNCH, launch->id, 0, node.num_total_tasks);
+        if (this->ready_order == READY_FIFO) {
+            launch->weight = 0;
+            launch->chain = 0;
+        } else if (this->ready_order == READY_CRITICAL_WORK) {
+            launch->weight = std::max(1, node.num_total_tasks);
+            launch->chain = node.critical_work;
+        } else {
+            launch->chain = node.critical_path;
+        }
+        launch->priority = launch->chain;
+        this->launches.push_back(launch);
+    }
+    this->num_outstanding += num_nodes;
+    for (int i = 0; i < num_nodes; i++) {
+        StealLaunch *launch = this->launches[base + i];
+        const int *successors = graph.successors(i);
+        launch->successors.reserve(graph.numSuccessors(i));
+        for (int j = 0; j < graph.numSuccessors(i); j++) {
+            DepEdge<StealLaunch> edge = {this->launches[base + successors[j]], 0};
+            launch->successors.push_back(edge);
+            edge.task->predecessors.push_back(launch->id);
+        }
+    }
+
+    // the roots register with the unfinished launches of deps like
+    // launchAsync() does
+    TaskID first = this->launches[base]->id;
+    for (int i = 0; i < num_nodes; i++) {
+        if (graph.numDeps(i) > 0) continue;
+        StealLaunch *launch = this->launches[base + i];
+        for (TaskID dep : deps) {
+            if (dep >= first) continue;
+            if (dep < this->first_id) {
+                if (this->retired_cancelled.contains(dep)) launch->is_cancelled = true;
+                continue;
+            }
+            StealLaunch *dep_launch = this->launches[dep - this->first_id];
+            int index = dep - dep_launch->id;
+            std::lock_guard<std::mutex> dep_lock(dep_launch->mutex);
+            if (dep_launch->is_completed) {
+                if (dep_launch->cancelledAt(index)) launch->is_cancelled = true;
+            } else {
+                DepEdge<StealLaunch> edge = {launch, index};
+                dep_launch->successors.push_back(edge);
+                launch->num_pending_deps++;
+                launch->predecessors.push_back(dep);
+            }
+        }
+        if (this->ready_order != READY_FIFO) this->raisePriorities(launch);
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        StealLaunch *launch = this->launches[base + i];
+        if (launch->num_pending_deps.fetch_sub(1) == 1) this->inject(launch, thread_id);
+    }
+    return first;
+}
+
+void TaskSystemParallelThreadPoolStealing::sync() {
+    // Work as one more worker until every launch completes, sleeping on
+    // wake like the workers do when there is nothing to steal
+    int thread_id = this->sync_helps ? this->claimDeque() : this->num_deques;
+    unsigned int seed = thread_id + 1;
+    StealRange range;
+    while (this->sync_helps && this->num_outstanding.load() > 0) {
+        if (this->findWork(thread_id, &seed, &range)) {
+            this->execute(thread_id, range);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(*this->wake_mutex);
+        long epoch = this->wake_epoch;
+        this->num_sleeping++;
+        lock.unlock();
+
+        if (this->findWork(thread_id, &seed, &range)) {
+            this->num_sleeping--;
+            this->execute(thread_id, range);
+            continue;
+        }
+
+        lock.lock();
+        this->tracer->record(thread_id, TRACE_PARK, -1);
+        while (epoch == this->wake_epoch && this->num_outstanding.load() > 0) {
+            this->wake->wait(lock);
+        }
+        this->tracer->record(thread_id, TRACE_UNPARK, -1);
+        this->num_sleeping--;
+    }
+    this->releaseDeque(thread_id);
+
+    {
+        std::unique_lock<std::mutex> lock(*this->completed_mutex);
+        this->completed->wait(lock, [this] { return this->num_outstanding.load() == 0; });
+    }
+
+    // launches other threads issued meanwhile or still wait() on stay
+    std::lock_guard<std::mutex> lock(*this->launch_mutex);
+    this->retireLaunches();
+}
+
+void TaskSystemParallelThreadPoolStealing::retireLaunches() {
+    // Frees the completed launches at the front, oldest first, so the
+    // launches whose sub-task edges point at a later one outlive it. The
+    // caller holds the launch mutex.
+    while (!this->launches.empty()) {
+        StealLaunch *launch = this->launches.front();
+        {
+            std::lock_guard<std::mutex> lock(launch->mutex);
+            if (!launch->is_completed || launch->num_pins.load() > 0) return;
+        }
+        // fused launches share the record of the launch they joined,
+        // which always directly precedes them
+        while (!this->launches.empty() && this->launches.front() == launch) {
+            if (launch->cancelledAt(this->first_id - launch->id)) this->retired_cancelled.insert(this->first_id);
+            this->launches.pop_front();
+            this->first_id++;
+        }
+        this->launch_pool->release(launch);
+    }
+}
+
+StealLaunch* TaskSystemParallelThreadPoolStealing::findLaunch(TaskID task_id) {
+    // nullptr for retired launches, which are complete; the caller holds
+    // the launch mutex
+    if (task_id < this->first_id || task_id >= this->next_id) return nullptr;
+    return this->launches[task_id - this->first_id];
+}
+
+void TaskSystemParallelThreadPoolStealing::wait(TaskID task_id) {
+    std::unique_lock<std::mutex> lock(*this->launch_mutex);
+    StealLaunch *launch = this->findLaunch(task_id);
+    if (!launch) return;
+    // pinned so that it is not retired before this thread sees it complete
+    launch->num_pins++;
+    lock.unlock();
+    int thread_id = currentWorker(this);
+    this->join(thread_id < 0 ? this->num_deques : thread_id, launch, nullptr);
+    launch->num_pins--;
+}
+
+void TaskSystemParallelThreadPoolStealing::waitGroup(TaskGroup* group) {
+    int thread_id = currentWorker(this);
+    this->join(thread_id < 0 ? this->num_deques : thread_id, nullptr, group);
+}
+
+void TaskSystemParallelThreadPoolStealing::join(int thread_id, StealLaunch *launch, TaskGroup *group) {
+    // Work like sync() does until the launch, or every launch of the
+    // group, completes; a worker waiting from inside runTask() keeps
+    // working from its own deque. A thread outside the task system only
+    // takes the ranges of the launch or the group off the injected
+    // queue, so it does not end up running another request's work.
+    auto is_completed = [launch, group] {
+        if (group) return group->num_outstanding.load() == 0;
+        std::lock_guard<std::mutex> lock(launch->mutex);
+        return launch->is_completed;
+    };
+    bool waited_only = thread_id == this->num_deques;
+    unsigned int seed = thread_id + 1;
+    auto find_work = [this, thread_id, launch, group, waited_only, &seed](StealRange *range) {
+        if (waited_only) return this->takeWaitedWork(launch, group, range);
+        return this->findWork(thread_id, &seed, range);
+    };
+
+    StealRange range;
+    this->num_joining++;
+    while (!is_completed()) {
+        if (find_work(&range)) {
+            this->execute(thread_id, range);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(*this->wake_mutex);
+        long epoch = this->wake_epoch;
+        this->num_sleeping++;
+        lock.unlock();
+
+        if (find_work(&range)) {
+            this->num_sleeping--;
+            this->execute(thread_id, range);
+            continue;
+        }
+        if (is_completed()) {
+            this->num_sleeping--;
+            break;
+        }
+
+        lock.lock();
+        this->tracer->record(thread_id, TRACE_PARK, -1);
+        while (epoch == this->wake_epoch) {
+            this->wake->wait(lock);
+        }
+        this->tracer->record(thread_id, TRACE_UNPARK, -1);
+        this->num_sleeping--;
+    }
+    this->num_joining--;
+}
+
+void TaskSystemParallelThreadPoolStealing::cancel(TaskID task_id) {
+    // ranges of the launch still in deques are dropped when next executed;
+    // a completed launch is left alone so that later dependents still run.
+    // A launch fused into another only drops its part of the chain.
+    std::lock_guard<std::mutex> launch_lock(*this->launch_mutex);
+    StealLaunch *launch = this->findLaunch(task_id);
+    if (!launch) return;
+    std::lock_guard<std::mutex> lock(launch->mutex);
+    if (launch->is_completed) return;
+    int index = task_id - launch->id;
+    if (index > 0) launch->fused.cancelFrom(index);
+    else launch->is_cancelled = true;
+}
+
+void TaskSystemParallelThreadPoolStealing::setDeadline(TaskID task_id, double seconds) {
+    std::lock_guard<std::mutex> launch_lock(*this->launch_mutex);
+    StealLaunch *launch = this->findLaunch(task_id);
+    if (!launch) return;
+    std::lock_guard<std::mutex> lock(launch->mutex);
+    if (launch->is_completed) return;
+    double deadline = CycleTimer::currentSeconds() + seconds;
+    int index = task_id - launch->id;
+    if (index > 0) launch->fused.setDeadline(index, deadline);
+    else launch->deadline = deadline;
+}
+
+void TaskSystemParallelThreadPoolStealing::addContinuation(TaskID task_id, IRunnable* continuation) {
+    // complete() runs it unless the launch completed already
+    std::unique_lock<std::mutex> launch_lock(*this->launch_mutex);
+    StealLaunch *launch = this->findLaunch(task_id);
+    if (launch) {
+        std::lock_guard<std::mutex> lock(launch->mutex);
+        if (!launch->is_completed) {
+            launch->continuations.push_back(continuation);
+            return;
+        }
+    }
+    launch_lock.unlock();
+    continuation->runTask(0, 1);
 }
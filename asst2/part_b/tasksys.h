@@ -2,9 +2,15 @@
 #define _TASKSYS_H
 
 #include "itasksys.h"
+#include "grain.h"
+#include "id_set.h"
+#include "placement.h"
+#include "small_vector.h"
+#include "trace.h"
+#include <atomic>
 #include <condition_variable>   
+#include <deque>
 #include <mutex>
-#include <queue>
 #include <thread>
 #include <vector>   
 
@@ -24,46 +30,216 @@ class TaskSystemSerial: public ITaskSystem {
         void sync();
 };
 
+// successors a Task stores without allocating
+#define TASK_INLINE_SUCCESSORS 4
+// launch records allocated at once by RecordPool
+#define TASK_SLAB_SIZE 64
+// launches up from a new one whose priorities it raises
+#define PRIORITY_WALK_DEPTH 32
+
+/*
+ * ReadyOrder: which ready task workers claim subtasks from first, set
+ * with TASKSYS_PRIORITY=fifo|path|work. Under path and work a task's
+ * priority is the length of the longest chain of launches that depend
+ * on it, counting each launch as 1 (path) or as its num_total_tasks
+ * (work); ties, and every task under fifo, go in launch order. Chains
+ * are only followed PRIORITY_WALK_DEPTH launches up from a new one, so
+ * longer chains rank by their last PRIORITY_WALK_DEPTH launches. The
+ * sleeping engine orders its ready heap by it, the stealing engine its
+ * injected queue.
+ */
+enum ReadyOrder {
+    READY_FIFO,
+    READY_CRITICAL_PATH,
+    READY_CRITICAL_WORK,
+};
+
+/*
+ * DepEdge: dependency of launch `task` on launch `index` of the chain
+ * fused into the record that holds the edge, 0 if it is not fused.
+ * Only that launch's cancellation is passed on along the edge.
+ */
+template <typename T>
+struct DepEdge {
+    T *task;
+    int index;
+};
+
+/*
+ * SubTaskEdge: sub-task dependency of launch `task` on launch `index`
+ * of the record that holds the edge, mapped as `map` says (see
+ * SubTaskDep). Tasks of the dependency below watch_from may have run
+ * before the edge was added, so the tasks mapped onto them wait for
+ * the whole dependency instead.
+ */
+template <typename T>
+struct SubTaskEdge {
+    T *task;
+    SubTaskDep map;
+    int watch_from;
+    int index;
+};
+
+/*
+ * FusedRunnable: a chain of launches fused into one (see
+ * IRunnable::fusable). Task i runs task i of each launch in launch
+ * order. Cancelling a launch of the chain other than the first only
+ * drops it and the launches after it, which depend on it, so task i
+ * runs the first num_live runnables.
+ */
+class FusedRunnable: public IRunnable {
+    public:
+        FusedRunnable();
+        // only appended to before any task of the chain runs
+        std::vector<IRunnable*> runnables;
+        std::atomic<int> num_live;
+        // (index, CycleTimer seconds) per deadline, guarded by mutex
+        std::vector<std::pair<int, double> > deadlines;
+        std::atomic<bool> has_deadlines;
+        std::mutex mutex;
+        void reset();
+        void append(IRunnable *runnable);
+        void cancelFrom(int index);
+        void setDeadline(int index, double deadline);
+        void expire();
+        bool dropped(int index);
+        void runTask(int task_id, int num_total_tasks) {
+            int num_live = this->num_live.load(std::memory_order_relaxed);
+            for (int i = 0; i < num_live; i++) this->runnables[i]->runTask(task_id, num_total_tasks);
+        }
+};
+
 class Task {
     public:
-        Task(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID> &deps);
-        ~Task();
+        Task();
         // variables
         int num_tasks;
-        int num_done;
-        int num_left;
+        std::atomic<int> num_done;
+        int num_left;   // guarded by TasksQueue::mutex
+        // dependencies not yet completed, the task is queued when it drops to zero
+        std::atomic<int> num_pending_deps;
         bool is_completed;
-        bool is_popped;
+        // written under TasksQueue::mutex once the successors are released
+        // and nothing else touches the task, which may be retired from then
+        std::atomic<bool> is_done;
+        // threads in wait() on the task, which keep it from being retired
+        std::atomic<int> num_pins;
+        // set by cancel(), an expired deadline or a cancelled dependency
+        std::atomic<bool> is_cancelled;
+        // CycleTimer seconds after which the task is cancelled, 0 for none
+        std::atomic<double> deadline;
         IRunnable *runnable;
+        // runnable once later launches are fused into this one
+        FusedRunnable fused;
+        // nullptr unless launched with runAsyncInGroup()
+        TaskGroup *group;
+        // run by complete(), guarded by mutex
+        std::vector<IRunnable*> continuations;
+        // whether any were added, guarded by the engine's launch mutex
+        bool has_continuations;
+        GrainSchedule schedule;
         TaskID task_id;
-        std::vector<TaskID> deps;
-        std::mutex *mutex;
-        std::mutex *completed_mutex;
-        std::condition_variable *completed;
+        // guarded by mutex until the task completes, read-only afterwards
+        SmallVector<DepEdge<Task>, TASK_INLINE_SUCCESSORS> successors;
+        // unfinished dependencies at launch, guarded by the engine's launch mutex
+        SmallVector<Task*, TASK_INLINE_SUCCESSORS> predecessors;
+        // own weight, and weight of the heaviest chain starting here,
+        // written under the engine's launch mutex; priority is the copy
+        // of chain the ready heap is ordered by
+        long weight;
+        std::atomic<long> chain;
+        long priority;      // guarded by TasksQueue::mutex
+        bool is_queued;     // guarded by TasksQueue::mutex
+        // Sub-task dependencies, guarded by TasksQueue::mutex: unfinished
+        // inputs per task (empty without any), the prefix of tasks with
+        // none left, whether the whole-launch deps are done, and the
+        // launches depending on this one's tasks
+        std::vector<int> sub_pending;
+        int num_ready;
+        bool is_released;
+        std::vector<SubTaskEdge<Task> > sub_successors;
+        std::atomic<bool> has_sub_successors;
+        std::mutex mutex;
+        std::condition_variable completed;
         // Getter, setter methods
         void set_id(TaskID id);
         TaskID get_id();
         // Task methods
+        void reset(IRunnable* runnable, int num_total_tasks);
+        bool cancelled();
+        bool cancelled_at(int index);
+        bool add_successor(Task *task, int index);
+        bool add_continuation(IRunnable *continuation);
         void complete();
         void wait();
-        void run(int task_id);
+        void run(int begin, int end);
+};
+
+/*
+ * RecordPool: hands out launch records (Task, StealLaunch) carved from
+ * slabs of TASK_SLAB_SIZE and takes them back once they are retired, so
+ * steady-state launches do not allocate. acquire() resets the record,
+ * which keeps what its vectors hold allocated. Guarded by the engine's
+ * launch mutex.
+ */
+template <typename T>
+class RecordPool {
+    public:
+        ~RecordPool() {
+            for (T *slab : this->slabs) delete[] slab;
+        }
+
+        T* acquire(IRunnable* runnable, int num_total_tasks) {
+            if (this->free_records.empty()) {
+                T *slab = new T[TASK_SLAB_SIZE];
+                this->slabs.push_back(slab);
+                // hand out the slab front to back
+                for (int i = TASK_SLAB_SIZE - 1; i >= 0; i--) this->free_records.push_back(&slab[i]);
+            }
+            T *record = this->free_records.back();
+            this->free_records.pop_back();
+            record->reset(runnable, num_total_tasks);
+            return record;
+        }
+
+        void release(T *record) {
+            this->free_records.push_back(record);
+        }
+
+    private:
+        std::vector<T*> slabs;
+        std::vector<T*> free_records;
 };
 
 class TasksQueue {
     public:
         int counter;
+        int num_outstanding;
+        // threads in wait_task() and wait_group()
+        int num_joining;
         bool done;
-        std::queue<Task*> *tasks;
+        // ready tasks, a max-heap on priority
+        std::vector<Task*> *tasks;
         std::mutex *mutex;
         std::condition_variable *has_tasks;
-        TasksQueue();
+        Tracer *tracer;
+        TasksQueue(Tracer *tracer);
         ~TasksQueue();
-        TaskID next_id();
-        Task* front();
-        void remove_front();
-        Task* pop_front();
+        TaskID next_id(int count = 1);
+        TaskID fuse(Task *task, IRunnable *runnable);
+        Task* pop_front(int *begin, int *end, int thread_id);
+        Task* wait_all(int *begin, int *end, bool help);
+        Task* wait_task(Task *task, int *begin, int *end, int thread_id);
+        Task* wait_group(TaskGroup *group, int *begin, int *end, int thread_id);
         void push_back(Task *task);
+        void raise_priorities(Task *task);
+        bool add_sub_dep(Task *task, Task *dep, int index, const SubTaskDep &map);
+        void sub_tasks_done(Task *dep, int begin, int end);
+        void task_done(Task *task);
         void set_done();
+    private:
+        Task* claim(int *begin, int *end, int index = 0);
+        void requeue(Task *task);
 };
 
 /*
@@ -83,6 +259,23 @@ class TaskSystemParallelSpawn: public ITaskSystem {
         void sync();
 };
 
+/*
+ * TaskSystemParallelSpawnArena: This class is the student's
+ * implementation of a parallel task execution engine that reuses a
+ * parked arena of spawned threads. See definition of ITaskSystem in
+ * itasksys.h for documentation of the ITaskSystem interface.
+ */
+class TaskSystemParallelSpawnArena: public ITaskSystem {
+    public:
+        TaskSystemParallelSpawnArena(int num_threads);
+        ~TaskSystemParallelSpawnArena();
+        const char* name();
+        void run(IRunnable* runnable, int num_total_tasks);
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                const std::vector<TaskID>& deps);
+        void sync();
+};
+
 /*
  * TaskSystemParallelThreadPoolSpinning: This class is the student's
  * implementation of a parallel task execution engine that uses a
@@ -114,19 +307,233 @@ class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
         void run(IRunnable* runnable, int num_total_tasks);
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
+        TaskID runAsyncWithSubTaskDeps(IRunnable* runnable, int num_total_tasks,
+                                       const std::vector<TaskID>& deps,
+                                       const std::vector<SubTaskDep>& sub_task_deps);
+        TaskID runAsyncInGroup(TaskGroup* group, IRunnable* runnable, int num_total_tasks,
+                               const std::vector<TaskID>& deps);
+        TaskID replay(const TaskGraph& graph, const std::vector<TaskID>& deps);
         void sync();
+        void wait(TaskID task_id);
+        void waitGroup(TaskGroup* group);
+        void cancel(TaskID task_id);
+        void setDeadline(TaskID task_id, double seconds);
+        void addContinuation(TaskID task_id, IRunnable* continuation);
     private:
         // debug and logging
         std::mutex *_debug_mutex;
         int _debug_counter;
         TasksQueue *tasks_queue;
+        // guards tasks, task_pool, first_id and retired_cancelled, as
+        // tasks may launch tasks
+        std::mutex *launch_mutex;
+        // tasks not yet retired, indexed by id - first_id
+        std::deque<Task*> *tasks;
+        // Task records are recycled through task_pool once retired
+        RecordPool<Task> *task_pool;
+        TaskID first_id;
+        // ids of the cancelled tasks retired so far, which later
+        // dependents are still cancelled by
+        IdSet retired_cancelled;
+        // whether sync() runs ready subtasks while it waits
+        bool sync_helps;
+        ReadyOrder ready_order;
         int num_threads;
         std::thread *threads;
+        ThreadPlacement placement;
+        Tracer *tracer;
+        void taskReady(Task *task, int thread_id);
+        void taskComplete(Task *task, int thread_id);
+        void taskExec(Task *task, int begin, int end, int thread_id);
+        Task* findTask(TaskID task_id);
+        void retireTasks();
+        TaskID launchAsync(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps,
+                           const std::vector<SubTaskDep>& sub_task_deps, TaskGroup *group);
+        void threadFunc();
+};
+
+/*
+ * StealLaunch: a bulk task launch as tracked by the work-stealing
+ * engine. A launch becomes ready once num_pending_deps drops to zero
+ * and is complete once num_done reaches num_total_tasks.
+ */
+class StealLaunch {
+    public:
+        StealLaunch();
+        IRunnable *runnable;
+        int num_total_tasks;
+        TaskID id;
+        // decides the size of the ranges workers stop splitting at
+        GrainSchedule schedule;
+        std::atomic<int> num_done;
+        std::atomic<int> num_pending_deps;
+        // set by cancel(), an expired deadline or a cancelled dependency
+        std::atomic<bool> is_cancelled;
+        // CycleTimer seconds after which the launch is cancelled, 0 for none
+        std::atomic<double> deadline;
+        // guarded by mutex, the launch may be retired once it is set
+        bool is_completed;
+        // threads in wait() on the launch, which keep it from being retired
+        std::atomic<int> num_pins;
+        std::vector<DepEdge<StealLaunch> > successors;
+        // ids of the dependencies unfinished at launch, guarded by the
+        // engine's launch mutex; retired ones are skipped when walked
+        SmallVector<TaskID, TASK_INLINE_SUCCESSORS> predecessors;
+        // own weight, and weight of the heaviest chain starting here,
+        // written under the engine's launch mutex; priority is the copy
+        // of chain the injected queue is ordered by, guarded by its mutex
+        long weight;
+        std::atomic<long> chain;
+        long priority;
+        // Sub-task dependencies, guarded by mutex: unfinished inputs per
+        // task (empty without any), whether the launch was injected, and
+        // the launches depending on this one's tasks. A dependency on a
+        // launch that was already injected covers the whole launch.
+        std::vector<int> sub_pending;
+        bool is_started;
+        std::vector<SubTaskEdge<StealLaunch> > sub_successors;
+        std::atomic<bool> has_sub_successors;
+        // runnable once later launches are fused into this one
+        FusedRunnable fused;
+        // nullptr unless launched with runAsyncInGroup()
+        TaskGroup *group;
+        // run by the thread that completes the launch, guarded by mutex
+        std::vector<IRunnable*> continuations;
+        std::mutex mutex;
+        void reset(IRunnable* runnable, int num_total_tasks);
+        bool cancelled();
+        bool cancelledAt(int index);
+};
+
+/*
+ * StealRange: the sub-tasks [begin, end) of a launch.
+ */
+struct StealRange {
+    StealLaunch *launch;
+    int begin;
+    int end;
+};
+
+/*
+ * WorkStealingDeque: fixed-capacity Chase-Lev deque of ranges. Only the
+ * owning worker may push() and pop() at the bottom; any thread may
+ * steal() from the top. push() fails instead of growing when full.
+ */
+class WorkStealingDeque {
+    public:
+        WorkStealingDeque(int capacity);
+        ~WorkStealingDeque();
+        bool push(const StealRange &range);
+        bool pop(StealRange *range);
+        bool steal(StealRange *range);
+    private:
+        struct Slot {
+            std::atomic<StealLaunch*> launch;
+            std::atomic<int> begin;
+            std::atomic<int> end;
+        };
+        std::atomic<long> top;
+        char pad[64];   // keep top and bottom on separate cache lines
+        std::atomic<long> bottom;
+        long mask;
+        Slot *slots;
+        void load(long index, StealRange *range);
+};
+
+/*
+ * TaskSystemParallelThreadPoolStealing: thread pool in which every
+ * worker owns a WorkStealingDeque. A ready launch is injected as a
+ * single range, which workers split in halves; idle workers take the
+ * injected range first in ReadyOrder, else steal the oldest (largest)
+ * range from a random victim before going to sleep.
+ * Threads calling sync() from outside work as one more worker until it
+ * returns, only one of them at a time with a deque of its own; those in
+ * wait() or waitGroup() only run ranges of what they wait for.
+ */
+class TaskSystemParallelThreadPoolStealing: public ITaskSystem {
+    public:
+        TaskSystemParallelThreadPoolStealing(int num_threads);
+        ~TaskSystemParallelThreadPoolStealing();
+        const char* name();
+        void run(IRunnable* runnable, int num_total_tasks);
+        TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
+                                const std::vector<TaskID>& deps);
+        TaskID runAsyncWithSubTaskDeps(IRunnable* runnable, int num_total_tasks,
+                                       const std::vector<TaskID>& deps,
+                                       const std::vector<SubTaskDep>& sub_task_deps);
+        TaskID runAsyncInGroup(TaskGroup* group, IRunnable* runnable, int num_total_tasks,
+                               const std::vector<TaskID>& deps);
+        TaskID replay(const TaskGraph& graph, const std::vector<TaskID>& deps);
+        void sync();
+        void wait(TaskID task_id);
+        void waitGroup(TaskGroup* group);
+        void cancel(TaskID task_id);
+        void setDeadline(TaskID task_id, double seconds);
+        void addContinuation(TaskID task_id, IRunnable* continuation);
+    private:
+        int num_threads;
+        std::thread *threads;
+        ThreadPlacement placement;
+        // One deque per worker, plus deques[num_threads], which one
+        // thread outside the task system at a time claims while it works
+        // in sync(). Others meanwhile, and outside threads in wait() or
+        // waitGroup(), work as worker num_deques, without a deque.
+        WorkStealingDeque **deques;
+        int num_deques;
+        std::atomic<bool> outside_deque_claimed;
+        bool sync_helps;
+        // one buffer per deque; threads without a deque record as worker
+        // num_deques and get a buffer of their own
+        Tracer *tracer;
+        // launches not yet retired, indexed by id - first_id
+        std::deque<StealLaunch*> launches;
+        // StealLaunch records are recycled through launch_pool once retired
+        RecordPool<StealLaunch> *launch_pool;
+        TaskID first_id;
+        TaskID next_id;
+        // ids of the cancelled launches retired so far, which later
+        // dependents are still cancelled by
+        IdSet retired_cancelled;
+        // guards launches, launch_pool, first_id, next_id and
+        // retired_cancelled, as tasks may launch tasks
+        std::mutex *launch_mutex;
+        // threads in wait() and waitGroup(), woken through wake whenever a
+        // launch completes
+        std::atomic<int> num_joining;
+        std::atomic<int> num_outstanding;
         std::mutex *completed_mutex;
         std::condition_variable *completed;
+        // ready launches not yet picked up by any worker, a max-heap on
+        // their launch's priority
+        std::vector<StealRange> *injected;
+        std::atomic<int> num_injected;
+        std::mutex *injected_mutex;
+        // idle workers sleep on wake until wake_epoch changes
+        std::atomic<int> num_sleeping;
+        long wake_epoch;
+        std::mutex *wake_mutex;
+        std::condition_variable *wake;
         bool done;
-        int taskExec(Task *task, int thread_id);
-        void threadFunc();
+        ReadyOrder ready_order;
+        void threadFunc(int thread_id);
+        StealLaunch* findLaunch(TaskID task_id);
+        void retireLaunches();
+        bool findWork(int thread_id, unsigned int *seed, StealRange *range);
+        int claimDeque();
+        void releaseDeque(int thread_id);
+        int splitGrain(StealLaunch *launch);
+        bool takeWaitedWork(StealLaunch *waited, TaskGroup *group, StealRange *range);
+        void keepGrain(StealRange *range, int grain);
+        void execute(int thread_id, StealRange range);
+        void join(int thread_id, StealLaunch *launch, TaskGroup *group);
+        TaskID launchAsync(IRunnable* runnable, int num_total_tasks, const std::vector<TaskID>& deps,
+                           const std::vector<SubTaskDep>& sub_task_deps, TaskGroup *group);
+        void raisePriorities(StealLaunch *launch);
+        void inject(StealLaunch *launch, int thread_id);
+        void complete(StealLaunch *launch, int thread_id);
+        void injectRange(StealRange range);
+        void subTasksDone(StealLaunch *launch, int begin, int end);
+        void notifySleepers(bool all);
 };
 
 #endif
@@ -0,0 +1,85 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+ * Summary of the timed repetitions of one test on one task system, in
+ * milliseconds. Percentiles use the nearest-rank method, so p99 of
+ * fewer than 100 samples is the maximum.
+ */
+struct BenchStats {
+    int reps;
+    double min;
+    double median;
+    double p90;
+    double p99;
+    double mean;
+    double stddev;
+};
+
+static double benchPercentile(const std::vector<double>& sorted, double q) {
+    int rank = (int)ceil(q * sorted.size());
+    return sorted[std::max(0, std::min(rank, (int)sorted.size()) - 1)];
+}
+
+static BenchStats benchStats(std::vector<double> samples_ms) {
+    BenchStats stats = {0, 0, 0, 0, 0, 0, 0};
+    if (samples_ms.empty()) return stats;
+    std::sort(samples_ms.begin(), samples_ms.end());
+    int n = samples_ms.size();
+    stats.reps = n;
+    stats.min = samples_ms[0];
+    stats.median = (n % 2) ? samples_ms[n / 2] : 0.5 * (samples_ms[n / 2 - 1] + samples_ms[n / 2]);
+    stats.p90 = benchPercentile(samples_ms, 0.90);
+    stats.p99 = benchPercentile(samples_ms, 0.99);
+    double sum = 0;
+    for (double sample : samples_ms) sum += sample;
+    stats.mean = sum / n;
+    double squares = 0;
+    for (double sample : samples_ms) squares += (sample - stats.mean) * (sample - stats.mean);
+    stats.stddev = (n > 1) ? sqrt(squares / (n - 1)) : 0;
+    return stats;
+}
+
+/*
+ * One result record of the benchmark JSON written by `runtasks -b`.
+ * The file holds an array with one record per task system.
+ */
+struct BenchRecord {
+    std::string test;
+    std::string engine;
+    int threads;
+    int warmup;
+    BenchStats stats;
+    std::vector<double> samples_ms;
+};
+
+static bool writeBenchJson(const char* path, const std::vector<BenchRecord>& records) {
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "[\n");
+    for (size_t i = 0; i < records.size(); i++) {
+        const BenchRecord& record = records[i];
+        const BenchStats& stats = record.stats;
+        fprintf(file, "  {\"test\": \"%s\", \"engine\": \"%s\", \"threads\": %d, \"warmup\": %d,\n",
+                record.test.c_str(), record.engine.c_str(), record.threads, record.warmup);
+        fprintf(file, "   \"stats\": {\"reps\": %d, \"min_ms\": %.6f, \"median_ms\": %.6f, \"p90_ms\": %.6f, "
+                "\"p99_ms\": %.6f, \"mean_ms\": %.6f, \"stddev_ms\": %.6f},\n",
+                stats.reps, stats.min, stats.median, stats.p90, stats.p99, stats.mean, stats.stddev);
+        fprintf(file, "   \"samples_ms\": [");
+        for (size_t j = 0; j < record.samples_ms.size(); j++) {
+            fprintf(file, "%s%.6f", j ? ", " : "", record.samples_ms[j]);
+        }
+        fprintf(file, "]}%s\n", (i + 1 == records.size()) ? "" : ",");
+    }
+    fprintf(file, "]\n");
+    fclose(file);
+    return true;
+}
+
+#endif
@@ -2,10 +2,14 @@
 #include <stdio.h>
 #include <getopt.h>
 #include <string>
+#include <string.h>
 #include <assert.h>
+#include <vector>
 
 #include "tasksys.h"
 #include "tests.h"
+#include "perf_counters.h"
+#include "bench.h"
 
 #define DEFAULT_NUM_THREADS 8
 #define DEFAULT_NUM_TIMING_ITERATIONS 3
@@ -16,6 +20,11 @@ void usage(const char* progname, std::string *testnames, int num_tests) {
     printf("Program Options:\n");
     printf("  -n  --num_threads  <INT>      Number of threads: <INT> (default=%d)\n", DEFAULT_NUM_THREADS);
     printf("  -i  --num_timing_iterations <INT> Number of timing iterations: <INT> (default=%d)\n", DEFAULT_NUM_TIMING_ITERATIONS);
+    printf("  -g  --grain <POLICY>[:<INT>]  Chunking of task ids: fixed, guided or adaptive,\n");
+    printf("                                with a minimum chunk size (default: per task system)\n");
+    printf("  -w  --warmup <INT>            Untimed iterations before timing starts (default=0)\n");
+    printf("  -b  --bench <FILE>            Benchmark mode: report median/p90/p99/stddev of the\n");
+    printf("                                timing iterations and write them to FILE as JSON\n");
     printf("  -?  --help                    This message\n");
     printf("Valid testnames are:");
     for(int i = 0; i < num_tests; i++) {
@@ -26,8 +35,10 @@ void usage(const char* progname, std::string *testnames, int num_tests) {
 enum TaskSystemType {
     SERIAL,
     PARALLEL_SPAWN,
+    PARALLEL_SPAWN_ARENA,
     PARALLEL_THREAD_POOL_SPINNING,
     PARALLEL_THREAD_POOL_SLEEPING,
+    PARALLEL_THREAD_POOL_STEALING,
     N_TASKSYS_IMPLS, // This must be in the last position.
 };
 
@@ -38,20 +49,54 @@ ITaskSystem *selectTaskSystemRefImpl(int num_threads, TaskSystemType type) {
         return new TaskSystemSerial(num_threads);
     } else if (type == PARALLEL_SPAWN) {
         return new TaskSystemParallelSpawn(num_threads);
+    } else if (type == PARALLEL_SPAWN_ARENA) {
+        return new TaskSystemParallelSpawnArena(num_threads);
     } else if (type == PARALLEL_THREAD_POOL_SPINNING) {
         return new TaskSystemParallelThreadPoolSpinning(num_threads);
     } else if (type == PARALLEL_THREAD_POOL_SLEEPING) {
         return new TaskSystemParallelThreadPoolSleeping(num_threads);
+    } else if (type == PARALLEL_THREAD_POOL_STEALING) {
+        return new TaskSystemParallelThreadPoolStealing(num_threads);
     } else {
         return NULL;
     }
 }
 
+/*
+ * Parses a grain policy such as "guided" or "fixed:8".
+ */
+bool parseGrainPolicy(const char* arg, GrainPolicy* policy, int* grain_size) {
+    std::string name = arg;
+    *grain_size = 1;
+    size_t colon = name.find(':');
+    if (colon != std::string::npos) {
+        *grain_size = atoi(name.c_str() + colon + 1);
+        name = name.substr(0, colon);
+        if (*grain_size < 1) return false;
+    }
+
+    if (name == "fixed") {
+        *policy = GRAIN_FIXED;
+    } else if (name == "guided") {
+        *policy = GRAIN_GUIDED;
+    } else if (name == "adaptive") {
+        *policy = GRAIN_ADAPTIVE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char** argv)
 {
-    const int n_tests = 31;
+    const int n_tests = 42;
     int num_threads = DEFAULT_NUM_THREADS;
     int num_timing_iterations = DEFAULT_NUM_TIMING_ITERATIONS;
+    GrainPolicy grain_policy = GRAIN_FIXED;
+    int grain_size = 1;
+    bool grain_selected = false;
+    int num_warmup_iterations = 0;
+    const char* bench_path = NULL;
 
     TestResults (*test[n_tests])(ITaskSystem*) = {
         simpleTestSync,
@@ -83,6 +128,19 @@ int main(int argc, char** argv)
         strictGraphDepsSmall,
         strictGraphDepsMedium,
         strictGraphDepsLarge,
+        criticalPathDepsTest,
+        nestedFibonacciTest,
+        workerLocalScratchTest,
+        reduceSumHistogramTest,
+        gridTilesTest,
+        cancelDepsTest,
+        graphReplayTest,
+        subTaskDepsTest,
+        fusedLaunchesTest,
+        taskGroupsTest,
+        continuationsTest,
+        outsideCallersTest,
+        waitLatencyTest,
     };
 
     std::string test_names[n_tests] = {
@@ -115,6 +173,19 @@ int main(int argc, char** argv)
         "strict_graph_deps_small_async",
         "strict_graph_deps_med_async",
         "strict_graph_deps_large_async",
+        "critical_path_deps_async",
+        "nested_fibonacci_async",
+        "worker_local_scratch",
+        "reduce_sum_histogram",
+        "grid_tiles",
+        "cancel_deps_async",
+        "graph_replay_async",
+        "subtask_deps_async",
+        "fused_launches_async",
+        "task_groups_async",
+        "continuations_async",
+        "outside_callers_async",
+        "wait_latency_async",
     };
  
     // Parse commandline options
@@ -122,10 +193,14 @@ int main(int argc, char** argv)
     static struct option long_options[] = {
         {"num_threads",           1, 0,  'n'},
         {"num_timing_iterations", 1, 0,  'i'},
+        {"grain",                 1, 0,  'g'},
+        {"warmup",                1, 0,  'w'},
+        {"bench",                 1, 0,  'b'},
         {"help",                  0, 0,  '?'},
+        {0, 0, 0, 0},
     };
 
-    while ((opt = getopt_long(argc, argv, "n:i:?", long_options, NULL)) != EOF) {
+    while ((opt = getopt_long(argc, argv, "n:i:g:w:b:?", long_options, NULL)) != EOF) {
 
         switch (opt) {
         case 'n':
@@ -134,6 +209,20 @@ int main(int argc, char** argv)
         case 'i':
             num_timing_iterations = atoi(optarg);
             break;
+        case 'g':
+            if (!parseGrainPolicy(optarg, &grain_policy, &grain_size)) {
+                fprintf(stderr, "Error: invalid grain policy %s!\n", optarg);
+                usage(argv[0], test_names, n_tests);
+                return 1;
+            }
+            grain_selected = true;
+            break;
+        case 'w':
+            num_warmup_iterations = atoi(optarg);
+            break;
+        case 'b':
+            bench_path = optarg;
+            break;
         case '?':
         default:
             usage(argv[0], test_names, n_tests);
@@ -147,7 +236,14 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    if (num_timing_iterations < 1 || num_warmup_iterations < 0) {
+        fprintf(stderr, "Error: need at least one timing iteration and no negative warmup!\n");
+        usage(argv[0], test_names, n_tests);
+        return 1;
+    }
+
     std::string test_name = argv[optind];
+    std::vector<BenchRecord> bench_records;
 
     bool found = false;
     for (int test_id = 0; test_id < n_tests; test_id++) {
@@ -162,15 +258,28 @@ int main(int argc, char** argv)
         printf("============================================================="
                "======================\n");
 
+        bool perf_warned = false;
         for (int i = 0; i < N_TASKSYS_IMPLS; i++) {
             double minT = 1e30;
-            for (int j = 0; j < num_timing_iterations; j++) {
+            std::string minCounters;
+            std::vector<double> samples_ms;
+            for (int j = -num_warmup_iterations; j < num_timing_iterations; j++) {
+
+                // Open the counters first so the task system's threads inherit them
+                PerfCounters counters;
+                if (!counters.available() && !perf_warned) {
+                    fprintf(stderr, "Note: perf counters unavailable, reporting time only\n");
+                    perf_warned = true;
+                }
 
                 // Create a new task system
                 ITaskSystem *t = selectTaskSystemRefImpl(num_threads, (TaskSystemType) i);
+                if (grain_selected) t->setGrainPolicy(grain_policy, grain_size);
                 
                 // Run test
+                counters.start();
                 TestResults result = test[test_id](t);
+                counters.stop();
 
                 // Check that the test result was correct
 
@@ -180,11 +289,33 @@ int main(int argc, char** argv)
                     exit(1);
                 }
 
-                minT = std::min(minT, result.time);
+                // warmup iterations (j < 0) are checked but not timed
+                if (j >= 0) {
+                    samples_ms.push_back(result.time * 1000);
+
+                    // counters are reported for the fastest iteration
+                    if (result.time < minT) {
+                        minT = result.time;
+                        minCounters = counters.available() ? counters.format() : "";
+                    }
+                }
 
                 // TODO: do this better
-                if( j+1 == num_timing_iterations) {
-                    printf("[%s]: \t\t[%.3f] ms\n", t->name(), minT * 1000);
+                if (j+1 == num_timing_iterations && !bench_path) {
+                    printf("[%s]: \t\t[%.3f] ms%s\n", t->name(), minT * 1000, minCounters.c_str());
+                } else if (j+1 == num_timing_iterations) {
+                    // benchmark mode reports the median, which a lucky run cannot skew
+                    BenchRecord record;
+                    record.test = test_name;
+                    record.engine = t->name();
+                    record.threads = num_threads;
+                    record.warmup = num_warmup_iterations;
+                    record.stats = benchStats(samples_ms);
+                    record.samples_ms = samples_ms;
+                    bench_records.push_back(record);
+                    printf("[%s]: \t\t[%.3f] ms  p90 %.3f  p99 %.3f  sd %.3f  (%d reps)%s\n",
+                           t->name(), record.stats.median, record.stats.p90, record.stats.p99,
+                           record.stats.stddev, record.stats.reps, minCounters.c_str());
                 }
 
                 // Shutdown task system so each timing run is from a clean start
@@ -201,5 +332,10 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    if (bench_path && !writeBenchJson(bench_path, bench_records)) {
+        fprintf(stderr, "Error: cannot write %s!\n", bench_path);
+        return 1;
+    }
+
     return 0;
 }
@@ -0,0 +1,144 @@
+#ifndef _PERF_COUNTERS_H
+#define _PERF_COUNTERS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum PerfCounterId {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CONTEXT_SWITCHES,
+    PERF_CACHE_MISSES,
+    PERF_FUTEX_CALLS,
+    N_PERF_COUNTERS,
+};
+
+/*
+ * PerfCounters: hardware and software counters around one test run,
+ * read with perf_event_open(2). Counters are opened before the task
+ * system is created and inherited by every thread it starts, so they
+ * cover the workers as well as the calling thread. Any counter the
+ * kernel refuses (no PMU in a VM, perf_event_paranoid, no tracefs for
+ * the futex tracepoint) is reported as "-"; outside Linux all are.
+ */
+class PerfCounters {
+    public:
+        PerfCounters() {
+            for (int i = 0; i < N_PERF_COUNTERS; i++) {
+                this->fds[i] = -1;
+                this->values[i] = 0;
+            }
+#ifdef __linux__
+            this->fds[PERF_CYCLES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+            this->fds[PERF_INSTRUCTIONS] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+            this->fds[PERF_CONTEXT_SWITCHES] = openCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+            this->fds[PERF_CACHE_MISSES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+            long futex_id = tracepointId("syscalls/sys_enter_futex");
+            if (futex_id >= 0) this->fds[PERF_FUTEX_CALLS] = openCounter(PERF_TYPE_TRACEPOINT, futex_id);
+#endif
+        }
+
+        ~PerfCounters() {
+#ifdef __linux__
+            for (int i = 0; i < N_PERF_COUNTERS; i++) {
+                if (this->fds[i] >= 0) close(this->fds[i]);
+            }
+#endif
+        }
+
+        bool available() const {
+            for (int i = 0; i < N_PERF_COUNTERS; i++) {
+                if (this->fds[i] >= 0) return true;
+            }
+            return false;
+        }
+
+        void start() {
+#ifdef __linux__
+            for (int i = 0; i < N_PERF_COUNTERS; i++) {
+                if (this->fds[i] < 0) continue;
+                ioctl(this->fds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(this->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+
+        void stop() {
+#ifdef __linux__
+            for (int i = 0; i < N_PERF_COUNTERS; i++) {
+                if (this->fds[i] < 0) continue;
+                ioctl(this->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+                unsigned long long value;
+                if (read(this->fds[i], &value, sizeof(value)) == sizeof(value)) {
+                    this->values[i] = value;
+                }
+            }
+#endif
+        }
+
+        // Counter columns for the runtasks result line
+        std::string format() const {
+            static const char* names[N_PERF_COUNTERS] = {
+                "cycles", "instr", "ctx-sw", "cache-miss", "futex",
+            };
+            std::string line;
+            char buffer[64];
+            for (int i = 0; i < N_PERF_COUNTERS; i++) {
+                if (this->fds[i] < 0) {
+                    snprintf(buffer, sizeof(buffer), "  %s -", names[i]);
+                } else {
+                    snprintf(buffer, sizeof(buffer), "  %s %llu", names[i], this->values[i]);
+                }
+                line += buffer;
+            }
+            if (this->fds[PERF_CYCLES] >= 0 && this->fds[PERF_INSTRUCTIONS] >= 0 && this->values[PERF_CYCLES] > 0) {
+                snprintf(buffer, sizeof(buffer), "  ipc %.2f",
+                         (double)this->values[PERF_INSTRUCTIONS] / this->values[PERF_CYCLES]);
+                line += buffer;
+            }
+            return line;
+        }
+
+    private:
+        int fds[N_PERF_COUNTERS];
+        unsigned long long values[N_PERF_COUNTERS];
+
+#ifdef __linux__
+        static int openCounter(unsigned int type, unsigned long long config) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = (type == PERF_TYPE_HARDWARE);
+            attr.exclude_hv = 1;
+            return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+
+        static long tracepointId(const char* event) {
+            const char* roots[] = {"/sys/kernel/tracing/events/", "/sys/kernel/debug/tracing/events/"};
+            for (const char* root : roots) {
+                std::string path = std::string(root) + event + "/id";
+                FILE* file = fopen(path.c_str(), "r");
+                if (!file) continue;
+                long id = -1;
+                if (fscanf(file, "%ld", &id) != 1) id = -1;
+                fclose(file);
+                if (id >= 0) return id;
+            }
+            return -1;
+        }
+#endif
+};
+
+#endif
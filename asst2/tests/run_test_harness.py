@@ -1,8 +1,12 @@
 import argparse
+import json
+import os
 import platform
 import re
+import statistics
 import subprocess
 import multiprocessing
+import tempfile
 
 STUDENT_BINARY_NAME = "runtasks"
 REFERENCE_BINARY_NAME = "runtasks_ref"
@@ -12,6 +16,11 @@ UNSPECIFIED_NUM_THREADS = -1
 
 PERF_THRESHOLD = 1.2
 NUM_TEST_RUNS = 5
+DEFAULT_BENCH_WARMUP = 2
+DEFAULT_BENCH_REPS = 15
+
+# a thread count is the knee when no larger count beats its speedup by this much
+KNEE_GAIN = 1.1
 
 LIST_OF_TESTS = [
     ("super_super_light", UNSPECIFIED_NUM_THREADS),
@@ -34,8 +43,10 @@ LIST_OF_IMPLEMENTATIONS_ORIG = [
     "REFERENCE [Parallel + Thread Pool + Sleep]",
     "STUDENT [Serial]",
     "STUDENT [Parallel + Always Spawn]",
+    "STUDENT [Parallel + Spawn Arena]",
     "STUDENT [Parallel + Thread Pool + Spin]",
     "STUDENT [Parallel + Thread Pool + Sleep]",
+    "STUDENT [Parallel + Thread Pool + Steal]",
 ]
 
 AUTHORS = ["STUDENT", "REFERENCE"]
@@ -66,6 +77,95 @@ def run_test(cmd, is_reference):
         print("%s solution failed correctness check!" % ("REFERENCE" if is_reference else "STUDENT"))
     return runtimes
 
+def run_bench_test(cmd, test_name, warmup, reps):
+    """Runs the student binary in benchmark mode and reads its JSON stats.
+
+    Returns the median runtime of every implementation, keyed like run_test.
+    """
+    runtimes = {}
+    fd, path = tempfile.mkstemp(suffix=".json")
+    os.close(fd)
+    try:
+        subprocess.check_output("%s -w %d -i %d -b %s %s" % (cmd, warmup, reps, path, test_name), shell=True)
+        with open(path) as f:
+            for record in json.load(f):
+                runtimes["STUDENT [%s]" % record["engine"]] = record["stats"]["median_ms"]
+    except Exception as e:
+        print(e)
+        print("STUDENT solution failed correctness check!")
+    finally:
+        os.remove(path)
+    return runtimes
+
+def run_reference_bench_test(cmd, test_name, warmup, reps):
+    """Median runtimes of the reference binary, which has no benchmark mode.
+
+    Each repetition is a separate single-iteration run; the first warmup
+    runs are discarded.
+    """
+    samples = {}
+    for i in range(warmup + reps):
+        runtimes = run_test("%s -i 1 %s" % (cmd, test_name), is_reference=True)
+        if i < warmup:
+            continue
+        for key in runtimes:
+            samples.setdefault(key, []).extend(runtimes[key])
+    return {key: statistics.median(samples[key]) for key in samples}
+
+def run_student(test_name, num_threads, args):
+    """Student runtimes of every implementation at one thread count."""
+    student_cmd = "./%s -n %d" % (STUDENT_BINARY_NAME, num_threads)
+    if args.bench:
+        return run_bench_test(student_cmd, test_name, args.warmup, args.reps)
+    all_runtimes = {}
+    for i in range(NUM_TEST_RUNS):
+        runtimes = run_test("%s %s" % (student_cmd, test_name), is_reference=False)
+        for key in runtimes:
+            all_runtimes.setdefault(key, []).extend(runtimes[key])
+    return {key: min(all_runtimes[key]) for key in all_runtimes}
+
+def find_knee(thread_counts, speedups):
+    """Smallest thread count whose speedup no larger count improves on by KNEE_GAIN."""
+    for i, count in enumerate(thread_counts):
+        if all(later < speedups[i] * KNEE_GAIN for later in speedups[i + 1:]):
+            return count
+    return thread_counts[-1]
+
+def sweep(test_name, thread_counts, engines, args):
+    """Runs test_name at every thread count and prints speedup and parallel
+    efficiency of each engine against the serial task system.
+
+    Returns {engine: knee thread count}.
+    """
+    runtimes = {}
+    for num_threads in thread_counts:
+        runtimes[num_threads] = run_student(test_name, num_threads, args)
+
+    # the serial task system ignores the thread count; use its best time
+    serial_key = "STUDENT [Serial]"
+    serial_times = [runtimes[n][serial_key] for n in thread_counts if serial_key in runtimes[n]]
+    if not serial_times:
+        print("Results for: %s: serial run failed, cannot compute speedup" % test_name)
+        return {}
+    serial_time = min(serial_times)
+
+    print("Results for: %s (serial %.3f ms)" % (test_name, serial_time))
+    print("{:<44}{:>8}{:>12}{:>10}{:>12}".format("", "THREADS", "TIME", "SPEEDUP", "EFFICIENCY"))
+    knees = {}
+    for engine in engines:
+        key = "STUDENT " + engine
+        counts = [n for n in thread_counts if key in runtimes[n]]
+        if not counts:
+            continue
+        speedups = [serial_time / runtimes[n][key] for n in counts]
+        knee = find_knee(counts, speedups)
+        knees[engine] = knee
+        for n, speedup in zip(counts, speedups):
+            print("{:<44}{:>8}{:>12.3f}{:>10.2f}{:>11.0f}%{}".format(
+                engine if n == counts[0] else "", n, runtimes[n][key], speedup,
+                100.0 * speedup / n, "  <- knee" if n == knee else ""))
+    return knees
+
 def pretty_print(test_name, runtimes):
     print("Results for: %s" % test_name)
     for implementation in LIST_OF_IMPLEMENTATIONS_ORIG:
@@ -113,6 +213,22 @@ if __name__ == '__main__':
                         help='Run async tests')
     parser.add_argument('-oa', '--run_only_async', action='store_true',
                         help='Run async tests')
+    parser.add_argument('-b', '--bench', action='store_true',
+                        help='Compare median runtimes over repeated runs instead of the '
+                             'minimum of %d runs' % NUM_TEST_RUNS)
+    parser.add_argument('-w', '--warmup', type=int, default=DEFAULT_BENCH_WARMUP,
+                        help='Untimed runs before measuring in --bench mode (%d by default)' % DEFAULT_BENCH_WARMUP)
+    parser.add_argument('-r', '--reps', type=int, default=DEFAULT_BENCH_REPS,
+                        help='Timed runs per implementation in --bench mode (%d by default)' % DEFAULT_BENCH_REPS)
+    parser.add_argument('-s', '--sweep', type=int, nargs='*', metavar='THREADS',
+                        help='Run the student binary at each of these thread counts '
+                             '(1..num_threads if none are given) and report speedup and '
+                             'parallel efficiency against [Serial] instead of comparing '
+                             'with the reference')
+    parser.add_argument('-e', '--engines', type=str, nargs='+',
+                        default=[x.split(" ", 1)[1] for x in LIST_OF_IMPLEMENTATIONS_ORIG
+                                 if x.startswith("STUDENT") and x != "STUDENT [Serial]"],
+                        help='Implementations to report in --sweep mode, e.g. "[Parallel + Thread Pool + Sleep]"')
 
     args = parser.parse_args()
 
@@ -141,6 +257,27 @@ if __name__ == '__main__':
     print("==============================================================="
           "=================")
 
+    if args.sweep is not None:
+        thread_counts = sorted(set(args.sweep)) if args.sweep else list(range(1, args.num_threads + 1))
+        knees_of_test = {}
+        for (test_name, num_threads) in test_names_and_num_threads:
+            print("==============================================================="
+                  "=================")
+            print("Sweeping test: %s over %s threads..." % (test_name, ",".join(str(n) for n in thread_counts)))
+            knees_of_test[test_name] = sweep(test_name, thread_counts, args.engines, args)
+
+        print("==============================================================="
+              "=================")
+        print("Scaling knee (thread count past which speedup grows < %d%%)" % round(100 * (KNEE_GAIN - 1)))
+        for engine in args.engines:
+            knees = [knees_of_test[t][engine] for t in knees_of_test if engine in knees_of_test[t]]
+            if knees:
+                print("{:<40}: median {}, per test {}".format(
+                    engine, statistics.median_low(knees),
+                    ", ".join("%s=%d" % (t, knees_of_test[t][engine])
+                              for t in knees_of_test if engine in knees_of_test[t])))
+        exit(0)
+
     runtimes_of_test = {}
     impl_perf_ok = {impl: True for impl in LIST_OF_IMPLEMENTATIONS}
 
@@ -165,6 +302,13 @@ if __name__ == '__main__':
             ref_cmd = "./%s_linux -n %d" % (REFERENCE_BINARY_NAME, num_threads);
         student_cmd = "./%s -n %d" % (STUDENT_BINARY_NAME, num_threads);
 
+        if args.bench:
+            all_runtimes = run_reference_bench_test(ref_cmd, test_name, args.warmup, args.reps)
+            all_runtimes.update(run_bench_test(student_cmd, test_name, args.warmup, args.reps))
+            pretty_print_with_comparison(test_name, all_runtimes, PERF_THRESHOLD, impl_perf_ok)
+            runtimes_of_test[test_name] = all_runtimes
+            continue
+
         cmds = [ref_cmd, student_cmd]
         is_references = [True, False]
         all_runtimes = {}
@@ -9,6 +9,8 @@
 
 #include "CycleTimer.h"
 #include "itasksys.h"
+#include "reduction.h"
+#include "task_graph.h"
 
 /*
 Sync tests
@@ -23,6 +25,9 @@ TestResults mathOperationsInTightForLoopFanInTest(ITaskSystem* t);
 TestResults mathOperationsInTightForLoopReductionTreeTest(ITaskSystem* t);
 TestResults spinBetweenRunCallsTest(ITaskSystem *t);
 TestResults mandelbrotChunkedTest(ITaskSystem* t);
+TestResults workerLocalScratchTest(ITaskSystem* t);
+TestResults reduceSumHistogramTest(ITaskSystem* t);
+TestResults gridTilesTest(ITaskSystem* t);
 
 Async with dependencies tests
 =============================
@@ -37,6 +42,13 @@ TestResults mathOperationsInTightForLoopReductionTreeAsyncTest(ITaskSystem* t);
 TestResults spinBetweenRunCallsAsyncTest(ITaskSystem *t);
 TestResults mandelbrotChunkedAsyncTest(ITaskSystem* t);
 TestResults simpleRunDepsTest(ITaskSystem *t);
+TestResults nestedFibonacciTest(ITaskSystem *t);
+TestResults cancelDepsTest(ITaskSystem *t);
+TestResults graphReplayTest(ITaskSystem *t);
+TestResults subTaskDepsTest(ITaskSystem *t);
+TestResults fusedLaunchesTest(ITaskSystem *t);
+TestResults taskGroupsTest(ITaskSystem *t);
+TestResults continuationsTest(ITaskSystem *t);
 */
 
 /*
@@ -171,6 +183,9 @@ class PingPongTask : public IRunnable {
               iters_(iters) {}
         ~PingPongTask() {}
 
+        // task i reads and writes the same block of elements in every launch
+        bool fusable() { return true; }
+
         static inline int ping_pong_iters(int i, int num_elements, int iters) {
             int max_iters = 2 * iters;
             return std::floor(
@@ -227,6 +242,383 @@ class RecursiveFibonacciTask: public IRunnable {
         }
 };
 
+/*
+ * Fork-join fibonacci: a launch of two tasks computes fib(n-1) and
+ * fib(n-2) of its idx into output[0] and output[1]. Tasks below the
+ * cutoff recurse serially, the others launch a child NestedFibonacciTask
+ * from inside runTask() and wait on it.
+ */
+class NestedFibonacciTask: public IRunnable {
+    public:
+        ITaskSystem *t_;
+        int idx_;
+        int cutoff_;
+        long output_[2];
+        NestedFibonacciTask(ITaskSystem *t, int idx, int cutoff)
+            : t_(t), idx_(idx), cutoff_(cutoff) {}
+        ~NestedFibonacciTask() {}
+
+        static long serialFib(int n) {
+            if (n < 2) return 1;
+            return serialFib(n-1) + serialFib(n-2);
+        }
+
+        void runTask(int task_id, int num_total_tasks) {
+            int n = idx_ - 1 - task_id;
+            if (n < cutoff_) {
+                output_[task_id] = serialFib(n);
+                return;
+            }
+            NestedFibonacciTask child(t_, n, cutoff_);
+            std::vector<TaskID> no_deps;
+            t_->wait(t_->runAsyncWithDeps(&child, 2, no_deps));
+            output_[task_id] = child.output_[0] + child.output_[1];
+        }
+};
+
+/*
+ * Node of a layered graph: each task writes frame * 100 plus its layer,
+ * which it derives from the outputs of the previous layer. Reading an
+ * output from an earlier frame, or one not yet written, gives a wrong
+ * value.
+ */
+class GraphLayerTask: public IRunnable {
+    public:
+        const int *frame_;
+        std::vector<int*> inputs_;
+        int *output_;
+        GraphLayerTask(const int *frame, const std::vector<int*> &inputs, int *output)
+            : frame_(frame), inputs_(inputs), output_(output) {}
+        ~GraphLayerTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int value = *frame_ * 100;
+            for (int *input : inputs_) {
+                value = std::max(value, input[task_id] + 1);
+            }
+            output_[task_id] = value;
+        }
+};
+
+/*
+ * Sets *target_ to value_ after spinning for spin_seconds_, so a launch
+ * reading it that does not depend on this one likely sees the old value.
+ */
+class SetValueTask: public IRunnable {
+    public:
+        double spin_seconds_;
+        int *target_;
+        int value_;
+        SetValueTask(double spin_seconds, int *target, int value)
+            : spin_seconds_(spin_seconds), target_(target), value_(value) {}
+        ~SetValueTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            double end_time = CycleTimer::currentSeconds() + spin_seconds_;
+            while (CycleTimer::currentSeconds() < end_time) {}
+            *target_ = value_;
+        }
+};
+
+/*
+ * Stage of a pipeline with sub-task dependencies: task i sums inputs
+ * [i * stride + begin, i * stride + end) of the previous stage, or
+ * writes i + 1 in the first stage. Inputs start out as -1, so reading
+ * one before its task ran clears ok_.
+ */
+class PipelineStageTask: public IRunnable {
+    public:
+        const int *input_;
+        int num_inputs_;
+        SubTaskDep map_;
+        int *output_;
+        std::atomic<bool> *ok_;
+        PipelineStageTask(const int *input, int num_inputs, SubTaskDep map, int *output, std::atomic<bool> *ok)
+            : input_(input), num_inputs_(num_inputs), map_(map), output_(output), ok_(ok) {}
+        ~PipelineStageTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            if (!input_) {
+                output_[task_id] = task_id + 1;
+                return;
+            }
+            int sum = 0;
+            int lo = std::max(0, task_id * map_.stride + map_.begin);
+            int hi = std::min(num_inputs_, task_id * map_.stride + map_.end);
+            for (int j = lo; j < hi; j++) {
+                if (input_[j] < 0) *ok_ = false;
+                sum += input_[j];
+            }
+            output_[task_id] = sum;
+        }
+};
+
+/*
+ * Each task adds one to its block of the input and writes it to the
+ * output, so launches of it may be fused if fusable_ says so. With
+ * expected_ set, the task instead checks that its block of the input
+ * equals it and clears ok_ otherwise.
+ */
+class AddOneTask: public IRunnable {
+    public:
+        int num_elements_;
+        const int *input_;
+        int *output_;
+        bool fusable_;
+        int expected_;
+        std::atomic<bool> *ok_;
+        AddOneTask(int num_elements, const int *input, int *output, bool fusable,
+                   int expected = -1, std::atomic<bool> *ok = nullptr)
+            : num_elements_(num_elements), input_(input), output_(output), fusable_(fusable),
+              expected_(expected), ok_(ok) {}
+        ~AddOneTask() {}
+
+        bool fusable() { return fusable_; }
+
+        void runTask(int task_id, int num_total_tasks) {
+            int per_task = (num_elements_ + num_total_tasks - 1) / num_total_tasks;
+            int end = std::min(num_elements_, (task_id + 1) * per_task);
+            for (int i = task_id * per_task; i < end; i++) {
+                if (expected_ >= 0) {
+                    if (input_[i] != expected_) *ok_ = false;
+                } else {
+                    output_[i] = input_[i] + 1;
+                }
+            }
+        }
+};
+
+/*
+ * Counts its runs, and clears ok_ if a run finds watched_ other than
+ * expected_: used as a continuation of a launch and as a launch that
+ * depends on one, to check what has completed by the time it runs.
+ */
+class CompletionCheckTask: public IRunnable {
+    public:
+        const std::atomic<int> *watched_;
+        int expected_;
+        std::atomic<int> num_run_;
+        std::atomic<bool> ok_;
+        CompletionCheckTask(const std::atomic<int> *watched, int expected)
+            : watched_(watched), expected_(expected), num_run_(0), ok_(true) {}
+        ~CompletionCheckTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            if (watched_->load() != expected_) ok_ = false;
+            num_run_++;
+        }
+};
+
+/*
+ * Each task spins for spin_seconds_ and counts itself in num_run_, so a
+ * test can tell how many tasks of a launch actually ran.
+ */
+class CountingSpinTask: public IRunnable {
+    public:
+        double spin_seconds_;
+        std::atomic<int> num_run_;
+        CountingSpinTask(double spin_seconds) : spin_seconds_(spin_seconds), num_run_(0) {}
+        ~CountingSpinTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            num_run_++;
+            double end_time = CycleTimer::currentSeconds() + spin_seconds_;
+            while (CycleTimer::currentSeconds() < end_time) {}
+        }
+};
+
+/*
+ * Runs the tasks of inner_ and draws a ticket from the shared sequence_
+ * when its first task starts and when its last task ends, so a test can
+ * tell in which order launches ran. Tickets are -1 until drawn.
+ */
+class SequencedTask: public IRunnable {
+    public:
+        IRunnable *inner_;
+        std::atomic<int> *sequence_;
+        std::atomic<int> num_started_;
+        std::atomic<int> num_ended_;
+        std::atomic<int> start_ticket_;
+        std::atomic<int> end_ticket_;
+        SequencedTask(IRunnable *inner, std::atomic<int> *sequence)
+            : inner_(inner), sequence_(sequence), num_started_(0), num_ended_(0),
+              start_ticket_(-1), end_ticket_(-1) {}
+        ~SequencedTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            if (num_started_++ == 0) start_ticket_ = (*sequence_)++;
+            inner_->runTask(task_id, num_total_tasks);
+            if (++num_ended_ == num_total_tasks) end_ticket_ = (*sequence_)++;
+        }
+};
+
+/*
+ * Each task squares its share of the input into a temporary from the
+ * worker's scratch arena and adds the sum of squares to the partial of
+ * the worker running it. Misaligned scratch or an out-of-range worker
+ * id clears ok_.
+ */
+class WorkerLocalSumTask: public IRunnable {
+    public:
+        ITaskSystem *t_;
+        int num_elements_;
+        const int *input_;
+        WorkerLocal<long> *partials_;
+        std::atomic<bool> *ok_;
+        WorkerLocalSumTask(ITaskSystem *t, int num_elements, const int *input,
+                           WorkerLocal<long> *partials, std::atomic<bool> *ok)
+            : t_(t), num_elements_(num_elements), input_(input), partials_(partials), ok_(ok) {}
+        ~WorkerLocalSumTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int elements_per_task = (num_elements_ + num_total_tasks - 1) / num_total_tasks;
+            int start_el = std::min(num_elements_, task_id * elements_per_task);
+            int end_el = std::min(num_elements_, start_el + elements_per_task);
+
+            int worker = t_->workerId();
+            ScratchScope scope(t_->scratch());
+            long *squares = t_->scratch()->allocArray<long>(end_el - start_el);
+            if (worker < 0 || worker >= t_->numWorkers() || (uintptr_t)squares % CACHE_LINE_SIZE != 0) {
+                *ok_ = false;
+                return;
+            }
+            for (int i = start_el; i < end_el; i++) {
+                squares[i - start_el] = (long)input_[i] * input_[i];
+            }
+            long sum = 0;
+            for (int i = start_el; i < end_el; i++) {
+                sum += squares[i - start_el];
+            }
+            (*partials_)[worker] += sum;
+        }
+};
+
+/*
+ * Each task takes bytes_ from the scratch arena of the thread running
+ * it without giving them back, and records the largest arena seen.
+ */
+class ScratchHoldTask: public IRunnable {
+    public:
+        ITaskSystem *t_;
+        size_t bytes_;
+        std::atomic<size_t> max_capacity_;
+        ScratchHoldTask(ITaskSystem *t, size_t bytes) : t_(t), bytes_(bytes), max_capacity_(0) {}
+        ~ScratchHoldTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            ScratchArena *arena = t_->scratch();
+            char *bytes = arena->allocArray<char>(bytes_);
+            for (size_t i = 0; i < bytes_; i += 64) bytes[i] = (char)task_id;
+            size_t capacity = arena->capacity();
+            size_t seen = max_capacity_.load();
+            while (capacity > seen && !max_capacity_.compare_exchange_weak(seen, capacity)) {}
+        }
+};
+
+/*
+ * Each task adds the sum of its share of the input to its partial.
+ */
+class SumReduction: public Reduction<long> {
+    public:
+        int num_elements_;
+        const int *input_;
+        SumReduction(int num_elements, const int *input)
+            : Reduction<long>(0), num_elements_(num_elements), input_(input) {}
+        ~SumReduction() {}
+
+        void accumulate(int task_id, int num_total_tasks, long &partial) {
+            int elements_per_task = (num_elements_ + num_total_tasks - 1) / num_total_tasks;
+            int start_el = std::min(num_elements_, task_id * elements_per_task);
+            int end_el = std::min(num_elements_, start_el + elements_per_task);
+            for (int i = start_el; i < end_el; i++) {
+                partial += input_[i];
+            }
+        }
+
+        void combine(long &into, const long &from) {
+            into += from;
+        }
+};
+
+/*
+ * Each task counts its share of the input into the bins of its partial
+ * histogram. Partials are large, so they are combined in parallel.
+ */
+class HistogramReduction: public Reduction<std::vector<int> > {
+    public:
+        int num_elements_;
+        const int *input_;
+        HistogramReduction(int num_elements, const int *input, int num_bins)
+            : Reduction<std::vector<int> >(std::vector<int>(num_bins, 0)),
+              num_elements_(num_elements), input_(input) {}
+        ~HistogramReduction() {}
+
+        void accumulate(int task_id, int num_total_tasks, std::vector<int> &partial) {
+            int elements_per_task = (num_elements_ + num_total_tasks - 1) / num_total_tasks;
+            int start_el = std::min(num_elements_, task_id * elements_per_task);
+            int end_el = std::min(num_elements_, start_el + elements_per_task);
+            for (int i = start_el; i < end_el; i++) {
+                partial[input_[i] % partial.size()]++;
+            }
+        }
+
+        void combine(std::vector<int> &into, const std::vector<int> &from) {
+            for (size_t i = 0; i < into.size(); i++) into[i] += from[i];
+        }
+
+        bool parallelCombine() {
+            return true;
+        }
+};
+
+/*
+ * Counts how often each pixel of a width x height image is covered by
+ * a tile; a correct grid launch covers each exactly once.
+ */
+class CoverImageTask: public IGridRunnable {
+    public:
+        int width_;
+        int *counts_;
+        CoverImageTask(int width, int *counts) : width_(width), counts_(counts) {}
+        ~CoverImageTask() {}
+
+        void runTile(const Tile& tile) {
+            for (int y = tile.begin[1]; y < tile.end[1]; y++) {
+                for (int x = tile.begin[0]; x < tile.end[0]; x++) {
+                    counts_[y * width_ + x]++;
+                }
+            }
+        }
+};
+
+/*
+ * 7-point stencil over the interior of an nx x ny x nz volume; the
+ * boundary of the output is left untouched.
+ */
+class StencilTask: public IGridRunnable {
+    public:
+        int nx_, ny_, nz_;
+        const float *input_;
+        float *output_;
+        StencilTask(int nx, int ny, int nz, const float *input, float *output)
+            : nx_(nx), ny_(ny), nz_(nz), input_(input), output_(output) {}
+        ~StencilTask() {}
+
+        void runTile(const Tile& tile) {
+            int sx = 1, sy = nx_, sz = nx_ * ny_;
+            for (int z = std::max(1, tile.begin[2]); z < std::min(nz_ - 1, tile.end[2]); z++) {
+                for (int y = std::max(1, tile.begin[1]); y < std::min(ny_ - 1, tile.end[1]); y++) {
+                    for (int x = std::max(1, tile.begin[0]); x < std::min(nx_ - 1, tile.end[0]); x++) {
+                        int i = z * sz + y * sy + x * sx;
+                        output_[i] = 0.4f * input_[i] +
+                                     0.1f * (input_[i - sx] + input_[i + sx] + input_[i - sy] +
+                                             input_[i + sy] + input_[i - sz] + input_[i + sz]);
+                    }
+                }
+            }
+        }
+};
+
 /*
  * Each task copies its task id into the output.
  */
@@ -714,6 +1106,176 @@ TestResults pingPongUnequalAsyncTest(ITaskSystem* t) {
     return pingPongTest(t, false, true, num_elements, base_iters);
 }
 
+/*
+ * Computation: Sums the squares of an array with per-worker partials
+ * and per-task temporaries from the scratch arenas, over many run()
+ * calls so the arenas are reset in between. Then issues a long chain
+ * of launches whose tasks keep what they take from scratch(), so that
+ * some launch is always running: the arenas must still be reset as
+ * each thread finishes its tasks, instead of growing with the chain.
+ * Also checks that threads outside the task system get arenas of
+ * their own.
+ */
+TestResults workerLocalScratchTest(ITaskSystem* t) {
+    int num_elements = 1 << 20;
+    int num_tasks = 256;
+    int num_launches = 32;
+
+    int *input = new int[num_elements];
+    long expected = 0;
+    for (int i = 0; i < num_elements; i++) {
+        input[i] = i % 1024 - 512;
+        expected += (long)input[i] * input[i];
+    }
+
+    std::atomic<bool> ok(true);
+    bool correct = true;
+    double start_time = CycleTimer::currentSeconds();
+    for (int i = 0; i < num_launches; i++) {
+        WorkerLocal<long> partials(t->numWorkers(), 0);
+        WorkerLocalSumTask task(t, num_elements, input, &partials, &ok);
+        t->run(&task, num_tasks);
+        long sum = 0;
+        for (int w = 0; w < partials.size(); w++) sum += partials[w];
+        if (sum != expected) correct = false;
+    }
+
+    // 1024 launches of 16 tasks of 4 KB each: 64 MB if never reset
+    int num_chained = 1024;
+    ScratchHoldTask hold(t, 4096);
+    std::vector<TaskID> deps;
+    for (int i = 0; i < num_chained; i++) {
+        deps.assign(1, t->runAsyncWithDeps(&hold, 16, deps));
+    }
+    t->sync();
+    bool bounded = hold.max_capacity_.load() <= 16 * SCRATCH_BLOCK_BYTES;
+    double end_time = CycleTimer::currentSeconds();
+
+    // threads outside the task system share a worker id but not an arena
+    ScratchArena *arenas[2];
+    std::thread outside[2];
+    for (int i = 0; i < 2; i++) {
+        outside[i] = std::thread([t, &arenas, i] {
+            arenas[i] = t->scratch();
+            if (t->scratch() != arenas[i]) arenas[i] = nullptr;
+        });
+    }
+    for (int i = 0; i < 2; i++) outside[i].join();
+    bool own_arenas = arenas[0] && arenas[1] && arenas[0] != arenas[1] && arenas[0] != t->scratch();
+
+    if (!ok) printf("ERROR: bad worker id or misaligned scratch memory\n");
+    if (!correct) printf("ERROR: sum of per-worker partials is wrong\n");
+    if (!own_arenas) printf("ERROR: outside threads share a scratch arena\n");
+    if (!bounded) printf("ERROR: scratch arenas grew to %zu bytes under overlapping launches\n",
+                         hold.max_capacity_.load());
+
+    delete[] input;
+    TestResults result;
+    result.passed = ok && correct && own_arenas && bounded;
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Computation: Sums an array and builds its histogram with one
+ * runReduce() launch each, and checks both against a serial pass.
+ */
+TestResults reduceSumHistogramTest(ITaskSystem* t) {
+    int num_elements = 1 << 22;
+    int num_tasks = 256;
+    int num_bins = 4096;
+    int num_iterations = 8;
+
+    int *input = new int[num_elements];
+    long expected_sum = 0;
+    std::vector<int> expected_bins(num_bins, 0);
+    for (int i = 0; i < num_elements; i++) {
+        input[i] = (int)(((unsigned int)i * 2654435761u) >> 8);
+        expected_sum += input[i];
+        expected_bins[input[i] % num_bins]++;
+    }
+
+    bool correct = true;
+    double start_time = CycleTimer::currentSeconds();
+    for (int i = 0; i < num_iterations; i++) {
+        SumReduction sum(num_elements, input);
+        HistogramReduction histogram(num_elements, input, num_bins);
+        t->runReduce(&sum, num_tasks);
+        t->runReduce(&histogram, num_tasks);
+        if (sum.result() != expected_sum || histogram.result() != expected_bins) {
+            correct = false;
+        }
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    if (!correct) printf("ERROR: reduced sum or histogram is wrong\n");
+
+    delete[] input;
+    TestResults result;
+    result.passed = correct;
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Computation: Covers a 2D image with tiles and runs a 3D stencil in
+ * blocks, with grid sizes that are not multiples of the tile sizes, in
+ * every tile order. Coverage and the stencil are checked against a
+ * serial pass.
+ */
+TestResults gridTilesTest(ITaskSystem* t) {
+    int image_size[3] = {1000, 700, 1};
+    int image_tile[3] = {32, 16, 1};
+    int volume_size[3] = {130, 96, 72};
+    int volume_tile[3] = {16, 8, 8};
+    int num_pixels = image_size[0] * image_size[1];
+    int num_voxels = volume_size[0] * volume_size[1] * volume_size[2];
+    TileOrder orders[] = {TILE_ORDER_ROW_MAJOR, TILE_ORDER_MORTON, TILE_ORDER_HILBERT};
+
+    int *counts = new int[num_pixels];
+    float *input = new float[num_voxels];
+    float *output = new float[num_voxels];
+    float *expected = new float[num_voxels];
+    for (int i = 0; i < num_voxels; i++) {
+        input[i] = (float)(i % 97) / 97.f;
+        expected[i] = 0.f;
+    }
+    int whole[3] = {volume_size[0], volume_size[1], volume_size[2]};
+    Tile everything = {{0, 0, 0}, {whole[0], whole[1], whole[2]}};
+    StencilTask(whole[0], whole[1], whole[2], input, expected).runTile(everything);
+
+    bool correct = true;
+    double start_time = CycleTimer::currentSeconds();
+    for (TileOrder order : orders) {
+        for (int i = 0; i < num_pixels; i++) counts[i] = 0;
+        for (int i = 0; i < num_voxels; i++) output[i] = 0.f;
+
+        CoverImageTask cover(image_size[0], counts);
+        StencilTask stencil(volume_size[0], volume_size[1], volume_size[2], input, output);
+        t->runGrid(&cover, image_size, image_tile, order);
+        t->runGrid(&stencil, volume_size, volume_tile, order);
+
+        for (int i = 0; i < num_pixels; i++) {
+            if (counts[i] != 1) correct = false;
+        }
+        for (int i = 0; i < num_voxels; i++) {
+            if (output[i] != expected[i]) correct = false;
+        }
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    if (!correct) printf("ERROR: grid tiles miss or repeat indices\n");
+
+    delete[] counts;
+    delete[] input;
+    delete[] output;
+    delete[] expected;
+    TestResults result;
+    result.passed = correct;
+    result.time = end_time - start_time;
+    return result;
+}
+
 /*
  * Computation: The following tests compute Fibonacci numbers using
  * recursion. Since the tasks are compute intensive, the tests show
@@ -1334,6 +1896,81 @@ TestResults strictDiamondDepsTest(ITaskSystem *t) {
     return result;
 };
 
+/*
+ * This test launches a root task, then many independent compute-heavy
+ * bulk launches and a long chain of small launches that all depend on
+ * the root. The chain is the critical path: a task system that serves
+ * ready launches in order runs the whole chain after the wide work, one
+ * that prioritizes long downstream chains overlaps the two. The root
+ * waits for a short spin so that everything becomes ready at once, and
+ * task systems that defer launches must finish the chain before the
+ * last wide launch starts. Nothing depends on the chain's last launch,
+ * so it ranks with the wide launches and is left out of that check.
+ */
+TestResults criticalPathDepsTest(ITaskSystem *t) {
+    const int num_wide = 64;
+    const int chain_length = 32;
+    const int array_size = 1 << 12;
+
+    bool *done = new bool[chain_length + 1]();
+    float *output = new float[num_wide * array_size];
+    std::atomic<int> sequence(0);
+    CountingSpinTask gate(0.005);
+
+    std::vector<bool*> root_dep_fs;
+    std::vector<std::vector<bool*> > chain_dep_fs(chain_length);
+    std::vector<IRunnable*> chain;
+    std::vector<IRunnable*> wide;
+    IRunnable* root = new StrictDependencyTask(root_dep_fs, done);
+    for (int i = 0; i < chain_length; i++) {
+        chain_dep_fs[i].push_back(done + i);
+        chain.push_back(new StrictDependencyTask(chain_dep_fs[i], done + i + 1));
+    }
+    std::vector<SequencedTask*> sequenced_wide;
+    for (int i = 0; i < num_wide; i++) {
+        wide.push_back(new MathOperationsInTightForLoopTask(array_size, output + i * array_size));
+        sequenced_wide.push_back(new SequencedTask(wide.back(), &sequence));
+    }
+    SequencedTask chain_end(chain[chain_length - 2], &sequence);
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    std::vector<TaskID> gate_deps = {t->runAsyncWithDeps(&gate, 1, no_deps)};
+    std::vector<TaskID> root_deps = {t->runAsyncWithDeps(root, 1, gate_deps)};
+    for (int i = 0; i < num_wide; i++) {
+        t->runAsyncWithDeps(sequenced_wide[i], 16, root_deps);
+    }
+    std::vector<TaskID> chain_deps = root_deps;
+    for (int i = 0; i < chain_length; i++) {
+        IRunnable *launch = (i == chain_length - 2) ? &chain_end : chain[i];
+        chain_deps[0] = t->runAsyncWithDeps(launch, 2, chain_deps);
+    }
+    bool deferred = sequence.load() == 0;
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    int last_wide_start = 0;
+    for (SequencedTask *task : sequenced_wide) last_wide_start = std::max(last_wide_start, task->start_ticket_.load());
+    bool chain_first = chain_end.end_ticket_.load() < last_wide_start;
+    if (deferred && !chain_first) {
+        printf("ERROR: the chain finished at ticket %d, after the last wide launch started at %d\n",
+               chain_end.end_ticket_.load(), last_wide_start);
+    }
+
+    TestResults result;
+    result.passed = done[chain_length] && (!deferred || chain_first);
+    result.time = end_time - start_time;
+
+    delete[] done;
+    delete[] output;
+    delete root;
+    for (IRunnable *task : chain) delete task;
+    for (IRunnable *task : wide) delete task;
+    for (SequencedTask *task : sequenced_wide) delete task;
+
+    return result;
+}
+
 /*
  * These tests generates and run a random DAG of n tasks and at most m edges,
  * and make all dependencies are satisfied.
@@ -1404,3 +2041,576 @@ TestResults strictGraphDepsMedium(ITaskSystem* t) {
 TestResults strictGraphDepsLarge(ITaskSystem* t) {
     return strictGraphDepsTestBase(t,1000,20000,0);
 }
+
+/*
+ * Computes a fibonacci number by divide and conquer, each level being a
+ * bulk launch issued and waited on from inside a task of the level
+ * above. Leaves are small, so most of the time goes to launching and
+ * joining nested launches.
+ */
+TestResults nestedFibonacciTest(ITaskSystem* t) {
+    int fib_index = 32;
+    int cutoff = 16;
+    int num_roots = 4;
+
+    std::vector<NestedFibonacciTask*> roots;
+    for (int i = 0; i < num_roots; i++) {
+        roots.push_back(new NestedFibonacciTask(t, fib_index, cutoff));
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    for (int i = 0; i < num_roots; i++) {
+        t->runAsyncWithDeps(roots[i], 2, no_deps);
+    }
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = true;
+    long expected = NestedFibonacciTask::serialFib(fib_index);
+    for (int i = 0; i < num_roots; i++) {
+        long actual = roots[i]->output_[0] + roots[i]->output_[1];
+        if (actual != expected) {
+            printf("ERROR: root %d computed fib(%d) = %ld, expected %ld\n", i, fib_index, actual, expected);
+            result.passed = false;
+        }
+        delete roots[i];
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Cancels a long launch right after issuing it and its chain of
+ * dependents, and gives another long launch a short deadline. Neither
+ * may run to completion, none of their dependents may run at all, and
+ * an unrelated launch must be unaffected, and so must the dependents of
+ * a launch that is cancelled after it completed. Task systems that
+ * complete launches inside runAsyncWithDeps() have nothing to cancel, so
+ * there only the unrelated launches are checked.
+ */
+TestResults cancelDepsTest(ITaskSystem* t) {
+    int num_tasks = 1000;
+    double spin_seconds = 1e-4;
+    double deadline_seconds = 2e-3;
+
+    CountingSpinTask cancelled(spin_seconds);
+    CountingSpinTask child(0);
+    CountingSpinTask grandchild(0);
+    CountingSpinTask independent(0);
+    CountingSpinTask expired(spin_seconds);
+    CountingSpinTask after_expired(0);
+    CountingSpinTask finished(0);
+    CountingSpinTask after_finished(0);
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    TaskID cancelled_id = t->runAsyncWithDeps(&cancelled, num_tasks, no_deps);
+    bool deferred = cancelled.num_run_ < num_tasks;
+    std::vector<TaskID> child_deps = {cancelled_id};
+    TaskID child_id = t->runAsyncWithDeps(&child, num_tasks, child_deps);
+    std::vector<TaskID> grandchild_deps = {child_id};
+    TaskID grandchild_id = t->runAsyncWithDeps(&grandchild, num_tasks, grandchild_deps);
+    t->cancel(cancelled_id);
+    t->runAsyncWithDeps(&independent, num_tasks, no_deps);
+
+    TaskID expired_id = t->runAsyncWithDeps(&expired, num_tasks, no_deps);
+    t->setDeadline(expired_id, deadline_seconds);
+    std::vector<TaskID> after_expired_deps = {expired_id};
+    t->runAsyncWithDeps(&after_expired, num_tasks, after_expired_deps);
+
+    TaskID finished_id = t->runAsyncWithDeps(&finished, num_tasks, no_deps);
+    t->wait(finished_id);
+    t->cancel(finished_id);
+    t->setDeadline(finished_id, 0);
+    std::vector<TaskID> after_finished_deps = {finished_id};
+    t->runAsyncWithDeps(&after_finished, num_tasks, after_finished_deps);
+
+    t->wait(grandchild_id);
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = independent.num_run_ == num_tasks && finished.num_run_ == num_tasks &&
+                    after_finished.num_run_ == num_tasks;
+    if (deferred) {
+        result.passed = result.passed && cancelled.num_run_ < num_tasks && expired.num_run_ < num_tasks &&
+                        child.num_run_ == 0 && grandchild.num_run_ == 0 && after_expired.num_run_ == 0;
+    }
+    if (!result.passed) {
+        printf("ERROR: ran %d/%d/%d tasks of the cancelled chain, %d/%d of the expired one, %d independent, "
+               "%d/%d of the one cancelled after completing\n",
+               cancelled.num_run_.load(), child.num_run_.load(), grandchild.num_run_.load(),
+               expired.num_run_.load(), after_expired.num_run_.load(), independent.num_run_.load(),
+               finished.num_run_.load(), after_finished.num_run_.load());
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Captures a small layered graph, like the launches of one frame of a
+ * pipeline, and replays it for many frames. Every other frame number is
+ * set by a launch that the replay depends on. Every output is checked
+ * after waiting for each launch of the frame by the TaskIDs the replay
+ * returns, so a replay that starts a launch before its dependencies
+ * complete, or returns the wrong TaskIDs, is caught.
+ */
+TestResults graphReplayTest(ITaskSystem* t) {
+    int num_layers = 4;
+    int width = 3;
+    int num_tasks = 32;
+    int num_frames = 500;
+
+    int frame = 0;
+    std::vector<int*> outputs;
+    std::vector<GraphLayerTask*> tasks;
+    TaskGraphCapture capture;
+    std::vector<TaskID> prev_ids, ids;
+    for (int layer = 0; layer < num_layers; layer++) {
+        std::vector<int*> inputs(outputs.end() - prev_ids.size(), outputs.end());
+        ids.clear();
+        for (int k = 0; k < width; k++) {
+            int *output = new int[num_tasks];
+            for (int i = 0; i < num_tasks; i++) output[i] = -1;
+            tasks.push_back(new GraphLayerTask(&frame, inputs, output));
+            ids.push_back(capture.runAsyncWithDeps(tasks.back(), num_tasks, prev_ids));
+            outputs.push_back(output);
+        }
+        prev_ids = ids;
+    }
+    TaskGraph graph(capture);
+
+    bool correct = true;
+    double start_time = CycleTimer::currentSeconds();
+    for (int f = 1; f <= num_frames && correct; f++) {
+        SetValueTask set_frame(1e-4, &frame, f);
+        std::vector<TaskID> deps;
+        if (f % 2) frame = f;
+        else deps.push_back(t->runAsyncWithDeps(&set_frame, 1, deps));
+        TaskID first = t->replay(graph, deps);
+        for (int n = 0; n < graph.size(); n++) t->wait(first + n);
+        for (int n = 0; n < (int)outputs.size(); n++) {
+            for (int i = 0; i < num_tasks; i++) {
+                if (outputs[n][i] != f * 100 + n / width) correct = false;
+            }
+        }
+        t->sync();
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    if (!correct) printf("ERROR: replayed graph ran a launch before its dependencies\n");
+
+    for (size_t n = 0; n < outputs.size(); n++) {
+        delete[] outputs[n];
+        delete tasks[n];
+    }
+    TestResults result;
+    result.passed = correct;
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Runs a pipeline whose stages depend on each other task by task: a
+ * stencil with a halo of one task, a gather of blocks of two tasks, and
+ * a stage mixing a one-to-one dependency with a whole-launch one. Each
+ * task checks that its inputs were written, and the final stage is
+ * compared with a serial run of the same stages.
+ */
+TestResults subTaskDepsTest(ITaskSystem* t) {
+    int num_tasks = 512;
+    int num_stencil_stages = 8;
+    int num_iterations = 20;
+
+    // stages: first, stencils, gather, last
+    int num_stages = num_stencil_stages + 3;
+    std::vector<int> sizes(num_stages, num_tasks);
+    sizes[num_stages - 2] = sizes[num_stages - 1] = num_tasks / 2;
+    std::vector<SubTaskDep> maps(num_stages);
+    for (int k = 1; k <= num_stencil_stages; k++) maps[k] = SubTaskDep{0, 1, -1, 2};
+    maps[num_stages - 2] = SubTaskDep{0, 2, 0, 2};
+    maps[num_stages - 1] = SubTaskDep{0, 1, 0, 1};
+
+    std::atomic<bool> ok(true);
+    std::vector<int*> outputs(num_stages);
+    std::vector<int*> expected(num_stages);
+    std::vector<PipelineStageTask*> stages(num_stages);
+    for (int k = 0; k < num_stages; k++) {
+        outputs[k] = new int[sizes[k]];
+        expected[k] = new int[sizes[k]];
+        const int *input = k ? outputs[k - 1] : nullptr;
+        stages[k] = new PipelineStageTask(input, k ? sizes[k - 1] : 0, maps[k], outputs[k], &ok);
+        PipelineStageTask serial(k ? expected[k - 1] : nullptr, k ? sizes[k - 1] : 0, maps[k], expected[k], &ok);
+        for (int i = 0; i < sizes[k]; i++) serial.runTask(i, sizes[k]);
+    }
+
+    bool correct = true;
+    double start_time = CycleTimer::currentSeconds();
+    for (int iter = 0; iter < num_iterations; iter++) {
+        for (int k = 0; k < num_stages; k++) {
+            for (int i = 0; i < sizes[k]; i++) outputs[k][i] = -1;
+        }
+        std::vector<TaskID> ids(num_stages);
+        std::vector<TaskID> no_deps;
+        ids[0] = t->runAsyncWithDeps(stages[0], sizes[0], no_deps);
+        for (int k = 1; k < num_stages; k++) {
+            SubTaskDep map = maps[k];
+            map.id = ids[k - 1];
+            std::vector<SubTaskDep> sub_task_deps = {map};
+            // the last stage also waits for all of the first, done long since
+            std::vector<TaskID> deps;
+            if (k == num_stages - 1) deps.push_back(ids[0]);
+            ids[k] = t->runAsyncWithSubTaskDeps(stages[k], sizes[k], deps, sub_task_deps);
+        }
+        t->sync();
+        for (int i = 0; i < sizes[num_stages - 1]; i++) {
+            if (outputs[num_stages - 1][i] != expected[num_stages - 1][i]) correct = false;
+        }
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    if (!ok) printf("ERROR: a task ran before the tasks it depends on\n");
+    if (!correct) printf("ERROR: pipeline output differs from the serial run\n");
+
+    for (int k = 0; k < num_stages; k++) {
+        delete[] outputs[k];
+        delete[] expected[k];
+        delete stages[k];
+    }
+    TestResults result;
+    result.passed = ok && correct;
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Issues a chain of fusable launches that each add one to the output of
+ * the one before, held back by a slow first launch so that it piles up
+ * behind it, and interrupted by a launch that checks a middle result
+ * and so must see it complete, by a fusable launch with a different
+ * number of tasks, and by a wait() on a launch in the middle of the
+ * chain. Task systems may fuse any run of the chain between those.
+ * Then cancels, and in a second round expires, a fusable launch issued
+ * behind a slow one: the launch it may be fused into must still run in
+ * full, and so must a dependent of that launch alone, while the
+ * cancelled launch's dependent must not run at all.
+ */
+TestResults fusedLaunchesTest(ITaskSystem* t) {
+    int num_elements = 64 * 1024;
+    int num_tasks = 64;
+    int num_launches = 200;
+    int check_after = 60;
+    int resize_at = 120;
+    int wait_on = 150;
+
+    std::vector<int*> buffers(num_launches + 1);
+    for (int k = 0; k <= num_launches; k++) {
+        buffers[k] = new int[num_elements];
+        for (int i = 0; i < num_elements; i++) buffers[k][i] = k ? -1 : 0;
+    }
+    std::vector<AddOneTask*> tasks;
+    std::atomic<bool> ok(true);
+    AddOneTask checker(num_elements, buffers[check_after], nullptr, false, check_after, &ok);
+    CountingSpinTask head(0.005);
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> deps(1, t->runAsyncWithDeps(&head, 2, std::vector<TaskID>()));
+    TaskID wait_id = -1;
+    for (int k = 0; k < num_launches; k++) {
+        tasks.push_back(new AddOneTask(num_elements, buffers[k], buffers[k + 1], true));
+        int launch_tasks = (k == resize_at) ? num_tasks / 2 : num_tasks;
+        TaskID id = t->runAsyncWithDeps(tasks.back(), launch_tasks, deps);
+        deps.assign(1, id);
+        if (k + 1 == check_after) t->runAsyncWithDeps(&checker, num_tasks, deps);
+        if (k + 1 == wait_on) wait_id = id;
+    }
+    t->wait(wait_id);
+    bool waited = buffers[wait_on][0] == wait_on && buffers[wait_on][num_elements - 1] == wait_on;
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    bool head_ran = true;
+    bool head_dependent_ran = true;
+    bool dependent_dropped = true;
+    for (int expire = 0; expire < 2; expire++) {
+        CountingSpinTask slow(0.005);
+        CountingSpinTask first(0);
+        AddOneTask fused(num_elements, buffers[0], buffers[1], true);
+        CountingSpinTask head_dependent(0);
+        CountingSpinTask dependent(0);
+        std::vector<TaskID> head_chain(1, t->runAsyncWithDeps(&slow, 2, std::vector<TaskID>()));
+        head_chain.assign(1, t->runAsyncWithDeps(&first, num_tasks, head_chain));
+        std::vector<TaskID> chain(1, t->runAsyncWithDeps(&fused, num_tasks, head_chain));
+        if (expire) t->setDeadline(chain[0], 0);
+        else t->cancel(chain[0]);
+        bool deferred = first.num_run_ == 0;
+        t->runAsyncWithDeps(&dependent, num_tasks, chain);
+        t->runAsyncWithDeps(&head_dependent, num_tasks, head_chain);
+        t->sync();
+        if (first.num_run_ != num_tasks) head_ran = false;
+        if (head_dependent.num_run_ != num_tasks) head_dependent_ran = false;
+        if (deferred && dependent.num_run_ != 0) dependent_dropped = false;
+    }
+
+    bool correct = true;
+    for (int i = 0; i < num_elements; i++) {
+        if (buffers[num_launches][i] != num_launches) correct = false;
+    }
+    if (!ok) printf("ERROR: a launch depending on a fused launch ran before it completed\n");
+    if (!waited) printf("ERROR: wait() on a fused launch returned before it completed\n");
+    if (!correct) printf("ERROR: fused launches computed the wrong result\n");
+    if (!head_ran) printf("ERROR: cancelling a fused launch dropped tasks of the launch it joined\n");
+    if (!head_dependent_ran) printf("ERROR: cancelling a fused launch cancelled a dependent of the launch it joined\n");
+    if (!dependent_dropped) printf("ERROR: a dependent of a cancelled fused launch ran\n");
+
+    for (int k = 0; k <= num_launches; k++) delete[] buffers[k];
+    for (AddOneTask *task : tasks) delete task;
+    TestResults result;
+    result.passed = ok && waited && correct && head_ran && head_dependent_ran && dependent_dropped;
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Two independent requests share the task system: a long launch in one
+ * group and a short chain of launches in another. Waiting for the
+ * chain's group must not wait for the long launch, so the chain must be
+ * complete and the long launch not yet when waitGroup() returns. Task
+ * systems that complete launches inside runAsyncWithDeps() have nothing
+ * to overlap, so there only the results are checked.
+ */
+TestResults taskGroupsTest(ITaskSystem* t) {
+    int num_slow_tasks = 2000;
+    double spin_seconds = 1e-4;
+    int num_elements = 16 * 1024;
+    int num_tasks = 64;
+    int num_launches = 8;
+
+    CountingSpinTask slow(spin_seconds);
+    std::vector<int*> buffers(num_launches + 1);
+    std::vector<AddOneTask*> tasks;
+    for (int k = 0; k <= num_launches; k++) {
+        buffers[k] = new int[num_elements];
+        for (int i = 0; i < num_elements; i++) buffers[k][i] = k ? -1 : 0;
+    }
+    for (int k = 0; k < num_launches; k++) {
+        tasks.push_back(new AddOneTask(num_elements, buffers[k], buffers[k + 1], true));
+    }
+    TaskGroup slow_group;
+    TaskGroup quick_group;
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    t->runAsyncInGroup(&slow_group, &slow, num_slow_tasks, no_deps);
+    bool deferred = slow.num_run_ < num_slow_tasks;
+    std::vector<TaskID> deps;
+    for (int k = 0; k < num_launches; k++) {
+        deps.assign(1, t->runAsyncInGroup(&quick_group, tasks[k], num_tasks, deps));
+    }
+    t->waitGroup(&quick_group);
+    bool overlapped = slow.num_run_ < num_slow_tasks;
+    bool correct = true;
+    for (int i = 0; i < num_elements; i++) {
+        if (buffers[num_launches][i] != num_launches) correct = false;
+    }
+    t->waitGroup(&slow_group);
+    bool slow_done = slow.num_run_ == num_slow_tasks;
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    if (!correct) printf("ERROR: waitGroup() returned before the launches of the group completed\n");
+    if (!slow_done) printf("ERROR: waitGroup() returned after %d of %d tasks\n", slow.num_run_.load(), num_slow_tasks);
+    if (deferred && !overlapped) printf("ERROR: waitGroup() waited for the launches of another group\n");
+
+    for (int k = 0; k <= num_launches; k++) delete[] buffers[k];
+    for (AddOneTask *task : tasks) delete task;
+    TestResults result;
+    result.passed = correct && slow_done && (!deferred || overlapped);
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Attaches continuations to a launch, which must each run once, after
+ * all of its tasks, and before wait() returns or a dependent launch
+ * starts. A continuation of a cancelled launch must still run, and one
+ * attached to a launch completed before the last sync() must run right
+ * away.
+ */
+TestResults continuationsTest(ITaskSystem* t) {
+    int num_tasks = 256;
+    double spin_seconds = 1e-5;
+    int num_rounds = 20;
+
+    bool passed = true;
+    double start_time = CycleTimer::currentSeconds();
+    for (int round = 0; round < num_rounds && passed; round++) {
+        CountingSpinTask producer(spin_seconds);
+        CompletionCheckTask first(&producer.num_run_, num_tasks);
+        CompletionCheckTask second(&first.num_run_, 1);
+        CompletionCheckTask consumer(&second.num_run_, 1);
+        CountingSpinTask cancelled(spin_seconds);
+        CompletionCheckTask after_cancel(&cancelled.num_run_, 0);
+
+        std::vector<TaskID> no_deps;
+        TaskID producer_id = t->runAsyncWithDeps(&producer, num_tasks, no_deps);
+        t->addContinuation(producer_id, &first);
+        t->addContinuation(producer_id, &second);
+        std::vector<TaskID> deps(1, producer_id);
+        TaskID consumer_id = t->runAsyncWithDeps(&consumer, num_tasks, deps);
+        TaskID cancelled_id = t->runAsyncWithDeps(&cancelled, num_tasks, deps);
+        t->cancel(cancelled_id);
+        t->addContinuation(cancelled_id, &after_cancel);
+
+        t->wait(producer_id);
+        bool ran_before_wait = first.num_run_ == 1 && second.num_run_ == 1;
+        t->wait(consumer_id);
+        t->sync();
+        CompletionCheckTask late(&consumer.num_run_, num_tasks);
+        t->addContinuation(consumer_id, &late);
+
+        passed = ran_before_wait && first.ok_ && second.ok_ && consumer.ok_ &&
+                 consumer.num_run_ == num_tasks && after_cancel.num_run_ == 1 && late.num_run_ == 1 && late.ok_;
+        if (!passed) {
+            printf("ERROR: continuations ran %d/%d/%d/%d times (%s), dependent launch %s\n",
+                   first.num_run_.load(), second.num_run_.load(), after_cancel.num_run_.load(),
+                   late.num_run_.load(), (first.ok_ && second.ok_ && late.ok_) ? "in order" : "early",
+                   consumer.ok_ ? "after them" : "before them");
+        }
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = passed;
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Several threads outside the task system share it at once, as the
+ * handlers of a server would: each issues chains of launches and waits
+ * for the last one by id, so the outside threads run tasks alongside
+ * the workers and each other, and now and then one of them calls
+ * sync(). Every chain must be complete when its wait() returns. Each
+ * round also cancels a launch and, once it completed, issues a launch
+ * that depends on it, which must not run if the cancel cut the first
+ * one short, not even when another caller's sync() came in between.
+ */
+TestResults outsideCallersTest(ITaskSystem* t) {
+    int num_callers = 4;
+    int num_rounds = 40;
+    int num_elements = 16 * 1024;
+    int num_tasks = 64;
+    int num_launches = 8;
+    double spin_seconds = 1e-4;
+
+    std::atomic<bool> correct(true);
+    std::atomic<bool> cancelled_ok(true);
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<std::thread> callers;
+    for (int c = 0; c < num_callers; c++) {
+        callers.push_back(std::thread([=, &correct, &cancelled_ok] {
+            std::vector<int*> buffers(num_launches + 1);
+            std::vector<AddOneTask*> tasks;
+            for (int k = 0; k <= num_launches; k++) buffers[k] = new int[num_elements];
+            for (int k = 0; k < num_launches; k++) {
+                tasks.push_back(new AddOneTask(num_elements, buffers[k], buffers[k + 1], c % 2 == 0));
+            }
+            for (int round = 0; round < num_rounds; round++) {
+                for (int k = 0; k <= num_launches; k++) {
+                    for (int i = 0; i < num_elements; i++) buffers[k][i] = k ? -1 : round;
+                }
+                std::vector<TaskID> deps;
+                for (int k = 0; k < num_launches; k++) {
+                    deps.assign(1, t->runAsyncWithDeps(tasks[k], num_tasks, deps));
+                }
+                t->wait(deps[0]);
+                for (int i = 0; i < num_elements; i++) {
+                    if (buffers[num_launches][i] != round + num_launches) correct = false;
+                }
+
+                CountingSpinTask dropped(spin_seconds);
+                CountingSpinTask after_dropped(0);
+                std::vector<TaskID> no_deps;
+                TaskID dropped_id = t->runAsyncWithDeps(&dropped, num_tasks, no_deps);
+                t->cancel(dropped_id);
+                t->wait(dropped_id);
+                std::vector<TaskID> dropped_deps(1, dropped_id);
+                t->wait(t->runAsyncWithDeps(&after_dropped, num_tasks, dropped_deps));
+                if (dropped.num_run_ < num_tasks && after_dropped.num_run_ > 0) cancelled_ok = false;
+
+                if (round % num_callers == c) t->sync();
+            }
+            for (int k = 0; k <= num_launches; k++) delete[] buffers[k];
+            for (AddOneTask *task : tasks) delete task;
+        }));
+    }
+    for (std::thread &caller : callers) caller.join();
+
+    // the same, with another caller's sync() certainly in between
+    CountingSpinTask dropped(spin_seconds);
+    CountingSpinTask after_dropped(0);
+    std::vector<TaskID> no_deps;
+    TaskID dropped_id = t->runAsyncWithDeps(&dropped, num_tasks, no_deps);
+    t->cancel(dropped_id);
+    t->wait(dropped_id);
+    std::thread other([t, num_tasks] {
+        CountingSpinTask unrelated(0);
+        t->runAsyncWithDeps(&unrelated, num_tasks, std::vector<TaskID>());
+        t->sync();
+    });
+    other.join();
+    std::vector<TaskID> dropped_deps(1, dropped_id);
+    t->wait(t->runAsyncWithDeps(&after_dropped, num_tasks, dropped_deps));
+    if (dropped.num_run_ < num_tasks && after_dropped.num_run_ > 0) cancelled_ok = false;
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    if (!correct) printf("ERROR: wait() from an outside thread returned before its launch completed\n");
+    if (!cancelled_ok) printf("ERROR: a launch ran although it depends on a cancelled launch\n");
+
+    TestResults result;
+    result.passed = correct && cancelled_ok;
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * One request queues a launch of slow tasks, then another waits for a
+ * launch of its own by id from a thread outside the task system. The
+ * waiting thread must only run tasks of its launch, so wait() returns
+ * well before a single slow task could have finished. Task systems
+ * that complete launches inside runAsyncWithDeps() have nothing to
+ * overlap, so there only the results are checked.
+ */
+TestResults waitLatencyTest(ITaskSystem* t) {
+    int num_slow_tasks = 8;
+    double spin_seconds = 0.1;
+    int num_quick_tasks = 64;
+
+    CountingSpinTask slow(spin_seconds);
+    CountingSpinTask quick(0);
+
+    double start_time = CycleTimer::currentSeconds();
+    std::vector<TaskID> no_deps;
+    t->runAsyncWithDeps(&slow, num_slow_tasks, no_deps);
+    bool deferred = slow.num_run_ < num_slow_tasks;
+    TaskID quick_id = t->runAsyncWithDeps(&quick, num_quick_tasks, no_deps);
+    double wait_start = CycleTimer::currentSeconds();
+    t->wait(quick_id);
+    double wait_seconds = CycleTimer::currentSeconds() - wait_start;
+    bool quick_done = quick.num_run_ == num_quick_tasks;
+    t->sync();
+    double end_time = CycleTimer::currentSeconds();
+
+    bool prompt = !deferred || wait_seconds < spin_seconds;
+    if (!quick_done) printf("ERROR: wait() returned after %d of %d tasks\n", quick.num_run_.load(), num_quick_tasks);
+    if (!prompt) printf("ERROR: wait() for a quick launch took %.1f ms behind slow tasks\n", wait_seconds * 1e3);
+
+    TestResults result;
+    result.passed = quick_done && prompt && slow.num_run_ == num_slow_tasks;
+    result.time = end_time - start_time;
+    return result;
+}